@@ -0,0 +1,68 @@
+#!/bin/python3
+
+import asyncio
+import click
+import numpy as np
+import sys
+
+import analyze
+import filters
+import frametime
+import simulator
+
+# Checks that the analysis finds what the simulator put in. Every filter has to
+# recover the rise time of the simulated display, with and without backlight
+# PWM. The median rise time of the runs has to be within the tolerance of the
+# true one, and the slowest 10% within spread times it, which catches the
+# edges of a run being mistaken for the response.
+
+SCENARIOS = {
+    "plain": {},
+    "pwm": {"pwm": 1200, "pwm_depth": .2},
+}
+
+def generate(runs, seed, model):
+    # Runs from the simulated device, parsed like analyze.py would
+    async def capture():
+        samples = []
+        stream = frametime.SimulatedStream(simulator.SimulatedDevice(model, seed=seed))
+        async with frametime.Device(stream=stream) as dev:
+            await dev.configure()
+            async for run in dev.runs(runs):
+                samples.append(analyze.Sample(run.variance, run.times.tolist(), run.values.tolist(), number=len(samples)))
+        return samples
+    return asyncio.run(capture())
+
+@click.command()
+@click.option("--runs", "-n", type=click.INT, default=200, help="Runs to simulate for every scenario")
+@click.option("--seed", type=click.INT, default=0, help="Seed for the simulated runs")
+@click.option("--rise", type=click.FloatRange(min=0, min_open=True), default=.002, help="Seconds the simulated display takes from 10% to 90%")
+@click.option("--tolerance", type=click.FLOAT, default=.15, help="How far off the median rise time may be")
+@click.option("--spread", type=click.FLOAT, default=2.5, help="How many times the true rise time the slowest 10% may take")
+def main(runs, seed, rise, tolerance, spread):
+    truth = rise * simulator.F_CPU
+    failed = []
+    print(f"{'scenario':>10} {'filter':>10} {'used':>6} {'rise_p50':>10} {'rise_p90':>10} {'error':>8}")
+    for (scenario, params) in SCENARIOS.items():
+        samples = generate(runs, seed, simulator.Model(rise=rise, **params))
+        for name in filters.FILTERS:
+            results = analyze.analyze_samples(samples, name, None)
+            used = results["risetimes"][results["reject"] == ""]
+            if not len(used):
+                print(f"{scenario:>10} {name:>10} {0:6d}")
+                failed.append(f"{scenario}/{name}")
+                continue
+            (p50, p90) = np.percentile(used, [50, 90])
+            error = p50 / truth - 1
+            line = f"{scenario:>10} {name:>10} {len(used):6d} {p50:10.0f} {p90:10.0f} {error:+8.1%}"
+            if abs(error) > tolerance or p90 > spread * truth:
+                failed.append(f"{scenario}/{name}")
+                line += " off"
+            print(line)
+
+    if failed:
+        sys.stderr.write(f"Rise time not recovered: {', '.join(failed)}\n")
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
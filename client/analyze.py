@@ -9,51 +9,111 @@ from pathlib import Path
 import sys
 import re
 
-def moving_average(a, n=5) :
-    ret = np.cumsum(a, dtype=float)
-    ret[n:] = ret[n:] - ret[:-n]
-    return ret[n - 1:] / n
+import filters
+import cache
+import journal
+
+REJECT_NO_SIGNAL = "no signal"
+REJECT_OVERRUN = "device overrun"
+REJECT_HID_TIMEOUT = "keyboard not ready"
+REJECT_TRIGGER_TIMEOUT = "light never moved"
 
 class Sample(object):
-    def __init__(self, variance, times, values):
+    def __init__(self, variance, times, values, unit="cycles", reports=None, health=None, inputs=None, number=None, reset=None):
         self.variance = variance
         self.times = times
         self.values = values
+        self.unit = unit
+        # Only in bursts, 1 where a report went out with the sample
+        self.reports = reports
+        # What the device said about the run, see client.health. None for
+        # captures from before the device told us
+        self.health = health
+        # When the trigger went out and the host saw input events, if the
+        # capture was probed
+        self.inputs = inputs
+        # The number of the run in the capture
+        self.number = number
+        # The Sample of the reset step, if it was measured too
+        self.reset = reset
 
     def points(self):
         return zip(self.times, self.values)
 
+def parse_segment(lines, number):
+    match = re.match(r"variance = (\d+)", lines[0])
+    assert(match != None)
+    variance = int(match.group(1))
+
+    # Anything between the variance and the header describes the run
+    health = None
+    inputs = None
+    start = 1
+    while not lines[start].startswith("Time("):
+        match = re.match(r"health: (.*)", lines[start])
+        if match is not None:
+            health = {name: int(value) for (name, value) in (x.split("=") for x in match.group(1).split())}
+        match = re.match(r"input: trigger=(\S+) events=(\S*)", lines[start])
+        if match is not None:
+            inputs = {
+                "trigger": float(match.group(1)),
+                "events": [float(x) for x in match.group(2).split(",") if x],
+            }
+        start += 1
+
+    # Header
+    match = re.match(r"Time\((\w+)\)", lines[start])
+    assert(match is not None)
+    unit = match.group(1)
+
+    times = []
+    values = []
+    reports = []
+    for line in lines[start + 1:]:
+        if line.startswith(journal.CHECKSUM):
+            break
+        match = re.match(r"(\d+(?:\.\d+)?);(\d+)(?:;(\d+))?", line)
+        assert(match is not None)
+        times.append(float(match.group(1)))
+        values.append(int(match.group(2)))
+        if match.group(3) is not None:
+            reports.append(int(match.group(3)))
+
+    return Sample(variance, times, values, unit, reports or None, health, inputs, number)
+
+def parse_run(lines):
+    match = re.match(r"Measurement (\d+)", lines[0])
+    assert(match != None)
+    number = int(match.group(1))
+
+    # The reset step has a segment of its own after the trigger, if it was
+    # measured
+    if "Reset\n" in lines:
+        split = lines.index("Reset\n")
+        sample = parse_segment(lines[1:split], number)
+        sample.reset = parse_segment(lines[split + 1:], number)
+        return sample
+    return parse_segment(lines[1:], number)
+
 def read_measurements(f):
     samples = []
-    line = f.readline()
-    while line != "":
-        match = re.match(r"Measurement (\d+)", line)
-        assert(match != None)
-
-        line = f.readline()
-        match = re.match(r"variance = (\d+)", line)
-        assert(match != None)
-        variance = int(match.group(1))
-
-        # Header
-        f.readline()
-
-        times = []
-        values = []
-        while True:
-            line = f.readline()
-            if line == "" or line == "\n":
-                break
-            match = re.match(r"(\d+(?:\.\d+)?);(\d+)", line)
-            assert(match is not None)
-            times.append(float(match.group(1)))
-            values.append(int(match.group(2)))
-
-        samples.append(Sample(variance, times, values))
-
-        line = f.readline()
-        if line == "":
-            break
+    lines = []
+    for line in f:
+        if line != "\n":
+            lines.append(line)
+            continue
+        if not lines:
+            continue
+
+        if journal.verify(lines):
+            samples.append(parse_run(lines))
+        else:
+            sys.stderr.write(f"{lines[0].strip()}: checksum mismatch, skipping it\n")
+        lines = []
+
+    if lines:
+        # The capture was cut off while this run was being written
+        sys.stderr.write(f"{lines[0].strip()}: incomplete, skipping it\n")
 
     return samples
 
@@ -79,12 +139,181 @@ class InputArg(object):
             self.title = split[0]
             self.path = Path(split[0])
 
+def idle_level(values, mask, default):
+    # Median light level of every run where mask is set, default for runs
+    # without any of it
+    empty = ~mask.any(axis=1)
+    picked = np.where(mask, values, np.nan)
+    picked[empty, 0] = default[empty]
+    return np.nanmedian(picked, axis=1)
+
+def steady_levels(values):
+    # The old and new light level of every run, and the values with the
+    # steady parts before and after the response flattened to them. The
+    # filters can leave transients at both ends of a run, this way the search
+    # for the edges only sees the response
+    (before, after) = filters.idle_mask(values)
+    old = idle_level(values, before, values[:, 1])
+    new = idle_level(values, after, values[:, -1])
+    return (old, new, np.where(before, old[:, None], np.where(after, new[:, None], values)))
+
+def analyze_runs(times, values):
+    # Find the response in every run at once. times and values are (runs,
+    # samples) arrays. Runs we can't use get a reject reason, the rest an empty
+    # string
+    rows = np.arange(values.shape[0])
+    (old, new, values) = steady_levels(values)
+
+    # Check if there's a significant difference between the initial and
+    # final light level
+    rise = new - old
+    reject = np.where(rise < 10, REJECT_NO_SIGNAL, "")
+
+    rise_lim = rise * .1
+
+    begin = np.argmax(values > (old + rise_lim)[:, None], axis=1)
+    end = np.argmin(values < (new - rise_lim)[:, None], axis=1)
+
+    risetimes = times[rows, end] - times[rows, begin]
+
+    midpoint = np.argmax(values > (old + (rise/2))[:, None], axis=1)
+
+    changetimes = times[rows, midpoint]
+
+    return (changetimes, risetimes, rise, reject)
+
+def health_of(samples, name):
+    # One field of the health of every run, nan where the capture doesn't have
+    # it
+    return np.array([s.health.get(name, np.nan) if s.health is not None else np.nan for s in samples], dtype=float)
+
+def reject_unhealthy(samples, reject):
+    # Runs where the device fell behind sampling, or couldn't get the key out,
+    # don't measure the application. Neither do runs where the device gave up
+    # waiting for the light to move
+    reject = np.where(health_of(samples, "trigger_timeout") > 0, REJECT_TRIGGER_TIMEOUT, reject)
+    reject = np.where(health_of(samples, "hid_timeout") > 0, REJECT_HID_TIMEOUT, reject)
+    return np.where(health_of(samples, "overruns") > 0, REJECT_OVERRUN, reject)
+
+def input_times(samples):
+    # When the host kernel saw the first input event of every run, nan for
+    # runs that weren't probed or where it saw none
+    first = [s.inputs["events"][0] if s.inputs is not None and s.inputs["events"] else np.nan for s in samples]
+    trigger = [s.inputs["trigger"] if s.inputs is not None else np.nan for s in samples]
+    return (np.array(trigger, dtype=float), np.array(first, dtype=float))
+
+def analyze_samples(samples, filter_name, cutoff, falling=False):
+    (times, values) = filters.stack_runs(samples, linear_interp)
+    (times, values, pwm) = filters.apply(filter_name, times, values, samples[0].unit, cutoff)
+    if falling:
+        # Turn the light going back into a rise, the deltas come out positive
+        values = -values
+
+    (changetimes, risetimes, deltas, reject) = analyze_runs(times, values)
+    (trigger, host) = input_times(samples)
+    return {
+        "runs": np.array([s.number for s in samples]),
+        "variances": np.array([s.variance for s in samples]),
+        "unit": np.array(samples[0].unit),
+        "changetimes": changetimes,
+        "risetimes": risetimes,
+        "deltas": deltas,
+        "reject": reject_unhealthy(samples, reject),
+        "pwm": pwm,
+        "poll_latency": health_of(samples, "poll_latency"),
+        "period_error": health_of(samples, "period_error"),
+        # Trigger until the host kernel had it, and from there until the
+        # light changed
+        "usb": host - trigger,
+        "host": changetimes - host,
+    }
+
+# Results of the reset segments are stored next to the ones of the trigger,
+# with their names prefixed
+RESET = "reset_"
+
+def analyze_file(path, filter_name, cutoff):
+    with open(path, "r") as f:
+        samples = read_measurements(f)
+
+    results = analyze_samples(samples, filter_name, cutoff)
+    # The reset undoes the trigger, which analyze_runs expects to be a rise
+    resets = [s.reset for s in samples if s.reset is not None]
+    if resets:
+        results.update((RESET + name, value) for (name, value) in analyze_samples(resets, filter_name, cutoff, True).items())
+    return results
+
+def reset_results(results):
+    # The results of the reset segments, None if the capture has none
+    found = {name[len(RESET):]: value for (name, value) in results.items() if name.startswith(RESET)}
+    return found or None
+
+def load_results(path, filter_name, cutoff, use_cache):
+    # The per-run results of a capture, from the cache if they are there.
+    # Only what goes into the per-run analysis is in the key, trimming is done
+    # on the results afterwards
+    params = {"filter": filter_name, "cutoff": cutoff}
+    if use_cache:
+        entry = cache.key(path, params)
+        results = cache.load(entry)
+        if results is not None:
+            return results
+    results = analyze_file(path, filter_name, cutoff)
+    if use_cache:
+        cache.store(entry, results)
+    return results
+
+def report(title, results, output, trim):
+    pwm = results["pwm"]
+    found = np.isfinite(pwm)
+    if np.any(found):
+        sys.stderr.write(f"{title}: backlight PWM around {np.median(pwm[found]):.0f}Hz in {np.count_nonzero(found)}/{len(pwm)} runs\n")
+
+    latency = results["poll_latency"]
+    if np.any(np.isfinite(latency)):
+        # 0xFFFF means the host took longer than we could count
+        slow = np.count_nonzero(latency == 0xFFFF)
+        sys.stderr.write(f"{title}: USB poll latency median {np.nanmedian(latency):.0f} cycles, worst sample period error {np.nanmax(results['period_error']):.0f} cycles")
+        sys.stderr.write(f", {slow} polls too slow to count\n" if slow else "\n")
+
+    reject = results["reject"]
+    for reason in np.unique(reject[reject != ""]):
+        sys.stderr.write(f"{title}: rejected {np.count_nonzero(reject == reason)}/{len(reject)} runs, {reason}\n")
+
+    accepted = reject == ""
+    if not np.any(accepted):
+        raise Exception("No significant difference in light level")
+
+    probed = accepted & np.isfinite(results["usb"])
+    if np.any(probed):
+        usb = np.median(results["usb"][probed])
+        host = np.median(results["host"][probed])
+        sys.stderr.write(f"{title}: median {usb:.0f} until the host kernel saw the key, {host:.0f} from there to the light changing ({np.count_nonzero(probed)} runs probed)\n")
+
+    changetimes = results["changetimes"][accepted]
+    risetimes = results["risetimes"][accepted]
+    deltas = results["deltas"][accepted]
+
+    signal_delta = sum(deltas) / len(deltas)
+
+    if trim != 0:
+        changetimes = stats.trimboth(changetimes, trim)
+    (loc, scale) = stats.uniform.fit(changetimes)
+    lag_min = loc
+
+    (rise_mu, rise_std) = stats.norm.fit(risetimes)
+
+    output.write(f"{title:>20} {signal_delta:10.3f} {lag_min:10.3f} {scale:10.3f} {rise_mu:10.3f} {rise_std:11.3f}\n")
+
 @click.command()
 @click.argument("data", nargs=-1)
 @click.option("--output", "-o", type=click.File("w"), default=sys.stdout, help="Write values to files instead of stdout")
 @click.option("--header", is_flag=True, help="Write a header")
 @click.option("--trim", "-t", type=float, default=0, help="Trim the lag times")
-def main(data, output, header, trim):
+@click.option("--filter", "-f", "filter_name", type=click.Choice(filters.FILTERS), default="average", help="Filter applied to the light level before finding the edges")
+@click.option("--cutoff", type=float, default=None, help="Lowpass cutoff in Hz, defaults to below the detected backlight PWM")
+@click.option("--cache/--no-cache", "use_cache", default=True, help="Reuse the per-run results of captures analyzed before")
+def main(data, output, header, trim, filter_name, cutoff, use_cache):
     if header:
         output.write(f"               title     signal    lag_min  lag_delta  rise_mean rise_stddev\n")
 
@@ -98,54 +327,12 @@ def main(data, output, header, trim):
         exit(1)
 
     for arg in args:
-        with open(arg.path, "r") as f:
-            samples = read_measurements(f)
-
-        changetimes = []
-        risetimes = []
-        deltas = []
-        for sample in samples:
-
-            times = np.array(sample.times)
-            values = np.array(sample.values)
-
-            (times, values) = linear_interp(times, values)
-            values = moving_average(values)
-            # The moving average discards the ends of the values to reduce error
-            times = times[2:-2]
-
-            # Check if there's a significant difference between the initial and
-            # final light level
-            rise = values[-1] - values[0]
-            if rise < 10:
-                raise Exception("No significant difference in light level")
-
-            deltas.append(rise)
-
-            rise_lim = rise * .1
-
-            begin = np.argmax(values > (values[1] + rise_lim))
-            end = np.argmin(values < (values[-1] - rise_lim))
-
-            risetime = (times[end] - times[begin])
-            risetimes.append(risetime)
-
-            midpoint = np.argmax(values > (values[1] + (rise/2)))
-
-            changetime = times[midpoint]
-            changetimes.append(changetime)
-
-        signal_delta = sum(deltas) / len(deltas)
-
-        changetimes = np.array(changetimes)
-        if trim != 0:
-            changetimes = stats.trimboth(changetimes, trim)
-        (loc, scale) = stats.uniform.fit(changetimes)
-        lag_min = loc
-
-        (rise_mu, rise_std) = stats.norm.fit(risetimes)
-
-        output.write(f"{arg.title:>20} {signal_delta:10.3f} {lag_min:10.3f} {scale:10.3f} {rise_mu:10.3f} {rise_std:11.3f}\n")
+        results = load_results(arg.path, filter_name, cutoff, use_cache)
+        report(arg.title, results, output, trim)
+        # The light going back after the reset, if it was measured
+        reset = reset_results(results)
+        if reset is not None:
+            report(f"{arg.title} reset", reset, output, trim)
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,232 @@
+#!/bin/python3
+
+import asyncio
+import click
+import json
+import random
+import subprocess
+import sys
+import time
+import tomllib
+from datetime import datetime, timezone
+from pathlib import Path
+
+import client
+import frametime
+from journal import open_journal
+
+# Runs a benchmark over several applications as described by a config file,
+# see benchmark/terminals.toml. All the applications are opened up front on
+# top of each other, and measured in blocks in a shuffled order each round.
+# That way slow drift, like the device or the screen warming up, is spread
+# over all of them instead of landing on whichever went last.
+
+RUN_DEFAULTS = {
+    "samples": 1000,
+    "block": 250,
+    "warmup": 20,
+    "delay": 0.04,
+    "settle": 1.0,
+    "convert": False,
+    "geometry": None,
+    "setup": [],
+    "launch_timeout": 30,
+    "input": [],
+    "reset_input": [],
+    "burst": 0,
+    "rate": 20,
+    "time_reset": False,
+}
+
+def load_config(path):
+    with open(path, "rb") as f:
+        config = tomllib.load(f)
+
+    run = {**RUN_DEFAULTS, **config.get("run", {})}
+    apps = [dict(app) for app in config.get("app", [])]
+    if not apps:
+        raise click.UsageError(f"{path}: no [[app]] to run")
+
+    names = set()
+    for app in apps:
+        if "name" not in app or "command" not in app:
+            raise click.UsageError(f"{path}: every app needs a name and a command")
+        if app["name"] in names:
+            raise click.UsageError(f"{path}: {app['name']} is in there twice")
+        names.add(app["name"])
+        # Anything not set for the app falls back to the run
+        for (key, value) in run.items():
+            app.setdefault(key, value)
+        app.setdefault("title", app["name"])
+        try:
+            (app["steps"], app["period"], _) = client.check_inputs(app["input"], app["reset_input"], app["burst"], app["rate"], app["time_reset"])
+        except ValueError as e:
+            raise click.UsageError(f"{path}: {app['name']}: {e}")
+    return (config, run, apps)
+
+def schedule(apps, rng):
+    # Yields (round, app, count) until every app has all its samples. Every
+    # round each app that still needs samples gets one block, in random order
+    remaining = {app["name"]: app["samples"] for app in apps}
+    number = 0
+    while any(remaining.values()):
+        order = [app for app in apps if remaining[app["name"]]]
+        rng.shuffle(order)
+        for app in order:
+            count = min(app["block"], remaining[app["name"]])
+            remaining[app["name"]] -= count
+            yield (number, app, count)
+        number += 1
+
+class X11Launcher(object):
+    # Starts the applications and moves their windows around with xdotool
+    def __init__(self, cwd):
+        self.cwd = cwd
+        self.processes = {}
+        self.windows = {}
+
+    def xdotool(self, *args, timeout=None):
+        result = subprocess.run(["xdotool", *args], capture_output=True, text=True, timeout=timeout, check=True)
+        return result.stdout.strip()
+
+    def start(self, app):
+        self.processes[app["name"]] = subprocess.Popen(app["command"], cwd=self.cwd)
+        # --sync blocks until the window shows up
+        window = self.xdotool("search", "--sync", "--onlyvisible", "--name", f"^{app['title']}$", timeout=app["launch_timeout"])
+        window = window.splitlines()[0]
+        self.windows[app["name"]] = window
+
+        self.xdotool("windowactivate", "--sync", window)
+        for command in app["setup"]:
+            subprocess.run([arg.format(window=window) for arg in command], check=True)
+        if app["geometry"] is not None:
+            (x, y, width, height) = app["geometry"]
+            self.xdotool("windowmove", "--sync", window, str(x), str(y))
+            self.xdotool("windowsize", "--sync", window, str(width), str(height))
+
+    def activate(self, app):
+        window = self.windows[app["name"]]
+        self.xdotool("windowactivate", "--sync", window)
+        self.xdotool("windowraise", window)
+        time.sleep(app["settle"])
+
+    def stop(self):
+        for process in self.processes.values():
+            process.terminate()
+        for process in self.processes.values():
+            try:
+                process.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                process.kill()
+
+class FakeLauncher(object):
+    # Doesn't start anything. Bringing an app forward just switches the
+    # simulated device over to the app's [app.simulate] model
+    def __init__(self, device):
+        import simulator
+        self.device = device
+        self.models = {}
+        self.simulator = simulator
+
+    def start(self, app):
+        self.models[app["name"]] = self.simulator.Model(**app.get("simulate", {}))
+
+    def activate(self, app):
+        self.device.model = self.models[app["name"]]
+
+    def stop(self):
+        pass
+
+@click.command()
+@click.argument("config_path", type=click.Path(exists=True, dir_okay=False))
+@click.option("--output", "-o", type=click.Path(file_okay=False), required=True, help="Directory to write the results to")
+@click.option("--seed", type=click.INT, default=None, help="Seed for the order of the blocks")
+@click.option("--simulate", is_flag=True, help="Run against a simulated device and don't start any applications")
+@click.option("--sync-every", type=click.INT, default=100, help="Sync the output to disk every n samples")
+@click.option("--device", default=None, help="Serial port or serial number of the device, the first one found by default")
+def main(config_path, output, seed, simulate, sync_every, device):
+    (config, run, apps) = load_config(config_path)
+
+    if seed is None:
+        seed = random.randrange(1 << 32)
+    rng = random.Random(seed)
+
+    output = Path(output)
+    output.mkdir(parents=True, exist_ok=True)
+
+    stream = None
+    if simulate:
+        import simulator
+        simulated = simulator.SimulatedDevice(seed=seed)
+        stream = frametime.SimulatedStream(simulated)
+        launcher = FakeLauncher(simulated)
+    else:
+        device = client.open_device(device)
+        launcher = X11Launcher(Path(config_path).parent)
+
+    asyncio.run(benchmark(device, stream, launcher, config, run, apps, seed, simulate, rng, output, sync_every))
+
+async def benchmark(port, stream, launcher, config, run, apps, seed, simulate, rng, output, sync_every):
+    # One session for the whole benchmark
+    async with frametime.Device(port, stream=stream) as device:
+        resolution = await device.configure([], run["convert"])
+        time_units = "us" if run["convert"] else "cycles"
+
+        index = {
+            "config": config,
+            "seed": seed,
+            "time_units": time_units,
+            "resolution": resolution,
+            "simulated": simulate,
+            "started": datetime.now(timezone.utc).isoformat(),
+            "apps": {app["name"]: {"file": f"{app['name']}.measure", "samples": app["samples"]} for app in apps},
+            "blocks": [],
+        }
+
+        journals = {}
+        try:
+            for app in apps:
+                launcher.start(app)
+            launcher.activate(apps[0])
+            if not simulate:
+                click.pause("Place the sensor on the window and press any key to start")
+
+            for app in apps:
+                journals[app["name"]] = open_journal(str(output / f"{app['name']}.measure"), sync_every=sync_every)
+
+            for (number, app, count) in schedule(apps, rng):
+                launcher.activate(app)
+                await device.configure(app["steps"])
+                (keys, period, reset) = (app["burst"], app["period"], app["time_reset"])
+
+                # The first few runs after a switch see the application waking up
+                async for _ in device.runs(app["warmup"], app["delay"], keys, period, reset):
+                    pass
+
+                journal = journals[app["name"]]
+                block = {
+                    "round": number,
+                    "app": app["name"],
+                    "first": journal.next_sample,
+                    "count": count,
+                    "warmup": app["warmup"],
+                    "started": datetime.now(timezone.utc).isoformat(),
+                }
+                sample = journal.next_sample
+                async for result in device.runs(count, app["delay"], keys, period, reset):
+                    journal.append(client.format_run(sample, result.variance, result.rows(resolution), time_units, keys != 0, result.health, reset=result.segment(resolution)))
+                    sample += 1
+                block["finished"] = datetime.now(timezone.utc).isoformat()
+                index["blocks"].append(block)
+                sys.stderr.write(f"Round {number}: {app['name']} {block['first']}-{journal.next_sample - 1}\n")
+        finally:
+            for journal in journals.values():
+                journal.close()
+            launcher.stop()
+
+            index["finished"] = datetime.now(timezone.utc).isoformat()
+            with open(output / "index.json", "w") as f:
+                json.dump(index, f, indent=2)
+
+if __name__ == "__main__":
+    main()
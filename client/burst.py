@@ -0,0 +1,141 @@
+#!/bin/python3
+
+import click
+import numpy as np
+import sys
+
+import analyze
+import filters
+
+# Typing bursts alternate two keys that change the same spot on the screen, like
+# a letter and backspace, so every key that makes it to the screen flips the
+# light level. Keys that land in the same frame cancel out and never show up.
+
+REJECT_NO_SIGNAL = analyze.REJECT_NO_SIGNAL
+
+def key_times(sample):
+    # The first key goes out at time 0, every report after that is marked in
+    # the sample it went out with. Reports alternate between press and
+    # release, so only every other one is a key
+    marked = [t for (t, r) in zip(sample.times, sample.reports) if r]
+    return np.array([0.0] + marked)[::2]
+
+def flips(times, values):
+    # Times the light level crossed from one side to the other. Use some
+    # hysteresis so noise around the middle doesn't count
+    low = np.percentile(values, 5)
+    high = np.percentile(values, 95)
+    if high - low < 10:
+        return None
+
+    state = np.full(len(values), -1)
+    state[values < low + (high - low) * .3] = 0
+    state[values > low + (high - low) * .7] = 1
+    # Hold the last known side through the middle
+    known = np.where(state >= 0, np.arange(len(state)), 0)
+    state = state[np.maximum.accumulate(known)]
+
+    change = np.flatnonzero((state[1:] != state[:-1]) & (state[:-1] >= 0)) + 1
+    return times[change]
+
+def match_keys(keys, changes):
+    # Pair every change with the key that caused it. The n-th change has to
+    # come from a key with the same parity, and we take the most recent one
+    # that could have done it. A queue longer than two keys therefore shows
+    # up as merged keys rather than lag
+    lags = np.full(len(keys), np.nan)
+    last = -1
+    for (n, change) in enumerate(changes):
+        candidates = [k for k in range(last + 1, len(keys)) if k % 2 == n % 2 and keys[k] <= change]
+        if not candidates:
+            continue
+        last = candidates[-1]
+        lags[last] = change - keys[last]
+    return lags
+
+def analyze_burst(sample, times, values):
+    keys = key_times(sample)
+    changes = flips(times, values)
+    if changes is None:
+        return None
+
+    lags = match_keys(keys, changes)
+    shown = np.isfinite(lags)
+    shown_at = keys[shown] + lags[shown]
+
+    offered = (len(keys) - 1) / (keys[-1] - keys[0]) if len(keys) > 1 else np.nan
+    sustained = (len(shown_at) - 1) / (shown_at[-1] - shown_at[0]) if len(shown_at) > 1 else np.nan
+    return {
+        "lags": lags,
+        "offered": offered,
+        "sustained": sustained,
+    }
+
+@click.command()
+@click.argument("data", nargs=-1)
+@click.option("--output", "-o", type=click.File("w"), default=sys.stdout, help="Write values to files instead of stdout")
+@click.option("--header", is_flag=True, help="Write a header")
+@click.option("--keys", "-k", type=click.File("w"), default=None, help="Write the lag of every key to this file")
+@click.option("--filter", "-f", "filter_name", type=click.Choice(filters.FILTERS), default="average", help="Filter applied to the light level before finding the changes")
+def main(data, output, header, keys, filter_name):
+    if header:
+        output.write(f"               title       keys     merged    lag_p50    lag_p95    lag_max    offered  sustained\n")
+    if keys is not None:
+        keys.write("title;run;key;lag\n")
+
+    args = [analyze.InputArg(x) for x in data]
+
+    for arg in args:
+        if arg.path.exists() and arg.path.is_file():
+            continue
+
+        sys.stderr.write(f"{arg.path}: file does not exist\n")
+        exit(1)
+
+    for arg in args:
+        with open(arg.path, "r") as f:
+            samples = analyze.read_measurements(f)
+        samples = [s for s in samples if s.reports is not None]
+        if not samples:
+            raise Exception(f"{arg.title}: no bursts in the capture")
+
+        # Lags are in the time unit of the capture, rates in keys per second
+        unit = samples[0].unit
+        scale = filters.UNIT_SECONDS[unit]
+
+        (times, values) = filters.stack_runs(samples, analyze.linear_interp)
+        (times, values, _) = filters.apply(filter_name, times, values, unit)
+
+        lags = []
+        offered = []
+        sustained = []
+        reject = analyze.reject_unhealthy(samples, np.full(len(samples), "", dtype=object))
+        for (run, sample) in enumerate(samples):
+            if reject[run] != "":
+                continue
+            result = analyze_burst(sample, times[run], values[run])
+            if result is None:
+                reject[run] = REJECT_NO_SIGNAL
+                continue
+            lags.append(result["lags"])
+            offered.append(result["offered"] / scale)
+            sustained.append(result["sustained"] / scale)
+            if keys is not None:
+                keys.writelines(f"{arg.title};{run};{k};{lag}\n" for (k, lag) in enumerate(result["lags"]))
+
+        for reason in np.unique(reject[reject != ""]):
+            sys.stderr.write(f"{arg.title}: rejected {np.count_nonzero(reject == reason)}/{len(reject)} runs, {reason}\n")
+        if not lags:
+            raise Exception("No significant difference in light level")
+
+        lags = np.concatenate(lags)
+        shown = lags[np.isfinite(lags)]
+        merged = np.count_nonzero(~np.isfinite(lags))
+        if len(shown) == 0:
+            raise Exception(f"{arg.title}: none of the keys showed up")
+        (p50, p95) = np.percentile(shown, [50, 95])
+
+        output.write(f"{arg.title:>20} {len(lags):10d} {merged:10d} {p50:10.3f} {p95:10.3f} {np.max(shown):10.3f} {np.nanmean(offered):10.3f} {np.nanmean(sustained):10.3f}\n")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,52 @@
+import os
+import json
+import hashlib
+import tempfile
+import zipfile
+import numpy as np
+from pathlib import Path
+
+# Bump this whenever the per-run analysis changes, so old results are not
+# picked up
+VERSION = 6
+
+def cache_dir():
+    base = os.environ.get("XDG_CACHE_HOME", Path.home() / ".cache")
+    return Path(base) / "frametime"
+
+def key(path, params):
+    # The cache is keyed on the content of the capture, not its name or mtime,
+    # so renamed or copied captures still hit
+    digest = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(1 << 20), b""):
+            digest.update(block)
+    digest.update(json.dumps(params, sort_keys=True).encode())
+    digest.update(str(VERSION).encode())
+    return digest.hexdigest()
+
+def load(key):
+    # Returns a dict of the per-run arrays stored for this capture, or None if
+    # it hasn't been analyzed with these parameters before
+    entry = cache_dir() / f"{key}.npz"
+    try:
+        with np.load(entry, allow_pickle=False) as data:
+            return {name: data[name] for name in data.files}
+    except (OSError, ValueError, zipfile.BadZipFile):
+        return None
+
+def store(key, results):
+    directory = cache_dir()
+    directory.mkdir(parents=True, exist_ok=True)
+    entry = directory / f"{key}.npz"
+
+    # Write to the side and move it in place so a killed run never leaves
+    # a half written entry behind
+    (fd, tmp) = tempfile.mkstemp(dir=directory, suffix=".tmp")
+    try:
+        with os.fdopen(fd, "wb") as f:
+            np.savez(f, **results)
+        os.replace(tmp, entry)
+    except BaseException:
+        os.unlink(tmp)
+        raise
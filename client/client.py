@@ -1,134 +1,324 @@
 #!/bin/python3
 
-import time
+import asyncio
+import os
 import click
 from serial.tools.list_ports import comports as scan_ports
-from serial import Serial
 import sys
-import struct
+import threading
+import numpy as np
 
-def find_device():
-    for port in scan_ports():
-        if port.vid == 0x16C0 and port.pid == 0x047A:
-            return port.device
+from journal import open_journal
+import frametime
+import hid
 
-def calibrate(serial):
-    serial.write(b"C\n")
+def find_devices():
+    # (serial number, port) of every device plugged in
+    ports = [port for port in scan_ports() if port.vid == 0x16C0 and port.pid == 0x047A]
+    return sorted(((port.serial_number or "", port.device) for port in ports))
 
-    if serial.read_until() != b"CSTA\n":
-        raise Exception("Expected calibration to start")
+def find_device(serial_number=None):
+    for (number, device) in find_devices():
+        if serial_number is None or number == serial_number:
+            return device
 
-    data = []
+def open_device(device):
+    # device is the serial port of a device, its serial number, or None for
+    # the first one we find
+    if device is not None and os.path.exists(device):
+        return device
+    port = find_device(device)
+    if port is None:
+        raise click.UsageError(f"No device {device}" if device is not None else "No device found")
+    return port
 
-    line = serial.read_until()
-    ts = 0
-    while line != b"CSUC\n" and line != b"CERR\n":
+# Terminators of a sample stream
+SUCCESS = b"\xFF\xFF\xFF\xFE"
+FAILURE = b"\xFF\xFF\xFF\xFF"
 
-        line = line[:-1]
-        time, value = line.split(b";")
-        ts += int(time)
-        data.append((ts, int(value)))
+# Value of a record whose time field holds the upper half of the device timer,
+# see firmware/protocol.h
+TIME_HIGH = 0xFFFD
 
-        line = serial.read_until()
+# Values of the records a measurement ends with, the time field holds the
+# number. See firmware/protocol.h
+TELEMETRY_POLL_LATENCY = 0xFFE0
+TELEMETRY_OVERRUNS = 0xFFE1
+TELEMETRY_FRAME_START = 0xFFE2
+TELEMETRY_FRAME_END = 0xFFE3
+TELEMETRY_HID_TIMEOUT = 0xFFE4
+TELEMETRY_SKIPPED = 0xFFE5
+TELEMETRY_TRIGGER_TIMEOUT = 0xFFE6
+TELEMETRY = {
+    TELEMETRY_POLL_LATENCY: "poll_latency",
+    TELEMETRY_OVERRUNS: "overruns",
+    TELEMETRY_FRAME_START: "frame_start",
+    TELEMETRY_FRAME_END: "frame_end",
+    TELEMETRY_HID_TIMEOUT: "hid_timeout",
+    TELEMETRY_SKIPPED: "skipped",
+    TELEMETRY_TRIGGER_TIMEOUT: "trigger_timeout",
+}
 
-    if line != b"CSUC\n":
-        raise Exception("Calibration failed")
+# Value of the record that starts the segment of the reset step, the time field
+# holds its variance
+SEGMENT_RESET = 0xFFF0
 
-    return data
+# Cycles between the samples of a measurement, and per USB frame
+F_CPU = 16000000
+SAMPLE_CYCLES = 896
+FRAME_CYCLES = 16000
+# The USB frame number is 11 bits
+FRAME_NUMBERS = 2048
 
-def measure(serial):
-    serial.write(b"M\n")
+# Command framing, see firmware/protocol.h
+FRAME_COMMAND = 0xA5
+FRAME_RESPONSE = 0x5A
+FRAME_HEADER_RESPONSE = 5
 
-    if serial.read_until() != b"MSTA\n":
-        raise Exception("Expected measurement to start")
+OP_HELLO = ord("H")
+OP_INFO = ord("I")
+OP_KEYCODES = ord("K")
+OP_SEQUENCE = ord("S")
+OP_MEASURE = ord("M")
+OP_CALIBRATE = ord("C")
+OP_BURST = ord("B")
+OP_CLOCK = ord("F")
+OP_TRIGGER = ord("T")
 
-    variance = serial.read(2)
-    (variance,) = struct.unpack("!H", variance)
+# Most samples OP_TRIGGER can keep from before the light moved, and the longest
+# it can wait for it in ms
+TRIGGER_MAX_PRETRIGGER = 31
+TRIGGER_MAX_WAIT = 1900
 
-    values = []
-    line = serial.read(4)
-    while line != b"\xFF\xFF\xFF\xFF" and line != b"\xFF\xFF\xFF\xFE":
-        values.append(line)
-        line = serial.read(4)
+# Passive monitoring streams blocks of packed samples, see firmware/protocol.h
+OP_MONITOR = ord("P")
+MONITOR_SYNC = 0xFFFC
+MONITOR_BLOCK = 64
+MONITOR_SAMPLE_CYCLES = 832
+MONITOR_BLOCK_BYTES = 6 + MONITOR_BLOCK * 5 // 4
 
-    if line != b"\xFF\xFF\xFF\xFE":
-        raise Exception("Measurement failed")
+# Flag of OP_MEASURE to measure the reset step too
+MEASURE_RESET = 0x01
 
-    data = []
-    if len(values) >= 1:
-        ts = 0
-        for line in values[1:]:
-            time, value = struct.unpack("!HH", line)
-            ts += time
-            # ts = time
-            data.append((ts, value))
+# Set in the value of records sampled while a report of a burst went out
+BURST_MARK = 0x8000
+# Longest a burst can take in ms, the keys times the time per key
+BURST_MAX_MS = 1800
 
-    return (variance, data)
+STATUS_ACCEPT = 0
+STATUS_REJECT = 1
 
-def handshake(serial):
-    welcome = serial.read_until()
-    if not welcome.startswith(b"HELO"):
-        raise Exception("Device did not greet us, is this a ScreenTimer?")
+def health(telemetry, times):
+    # How the measurement went, from the telemetry and the raw sample times.
+    # None if the device didn't tell us
+    if not telemetry:
+        return None
 
-def info(serial):
-    serial.write(b"I\n")
-    resolution = serial.read_until()
+    times = np.asarray(times, dtype=np.int64)
+    elapsed = int(times[-1] - times[0]) if len(times) else 0
+    # Samples held back waiting for the light took their frames too
+    elapsed += telemetry.get("skipped", 0) * SAMPLE_CYCLES
+    # The frame number wraps every 2 seconds, a long burst can go past that.
+    # Use the time the samples took to tell how many times it did
+    frames = (telemetry["frame_end"] - telemetry["frame_start"]) % FRAME_NUMBERS
+    frames += FRAME_NUMBERS * round((elapsed / FRAME_CYCLES - frames) / FRAME_NUMBERS)
+    # The sample loop is cycle counted, any sample that isn't exactly one
+    # period after the last was held up
+    period_error = int(np.max(np.abs(np.diff(times) - SAMPLE_CYCLES))) if len(times) > 1 else 0
 
-    if not resolution.startswith(b"RESL"):
-        raise Exception("Incorrect info response")
-    resolution = resolution[4:-1]
-    # The string is in C style int formatting, so we have to remove any
-    # trailing UL
-    resolution = resolution.strip(b"UL")
-    resolution = int(resolution)
+    status = {
+        "poll_latency": telemetry["poll_latency"],
+        "overruns": telemetry["overruns"],
+        "usb_frames": frames,
+        "period_error": period_error,
+        "hid_timeout": telemetry["hid_timeout"],
+    }
+    # Only when the device held the samples back until the light moved
+    if "skipped" in telemetry:
+        status["skipped"] = telemetry["skipped"]
+        status["trigger_timeout"] = telemetry["trigger_timeout"]
+    return status
 
-    return (resolution, )
+# How far before the estimated start of a run an input event can be, the
+# estimate is late by however long the first records took to arrive
+ALIGN_MARGIN = 2000000
 
-def keycodes(serial, test, reset):
-    serial.write(b"K %d %d\n" % (test, reset))
-    answer = serial.read_until()
+def align(probe, times, arrivals):
+    # Times of the input events of the run, in cycles on the device timeline.
+    # arrivals are when the records of the samples at times were read. Every
+    # record arrives some time after it was sampled, so the earliest arrival
+    # relative to the time of its record is the closest we get to where the
+    # device timer started
+    zero = np.min(np.asarray(arrivals) - np.asarray(times) * 1e9 / F_CPU)
+    events = probe.take(zero - ALIGN_MARGIN, arrivals[-1])
+    return [round((t - zero) * F_CPU / 1e9) for t in events]
 
-    if answer != b"ACPT\n":
-        raise Exception("Keycode not accepted")
+# USB frames to time the clock against, a millisecond each
+CLOCK_FRAMES = 1000
 
-def ts_to_us(resolution, data):
-    # Prescale the resolution to number of microseconds per tick. Should keep
-    # the floating point arithmatic somewhat accurate
-    resolution = 1 / (resolution / 1000000)
-    newData = []
-    for (ts, val) in data:
-        ms = resolution * ts
-        newData.append((ms, val))
+def inputs_to_us(resolution, inputs):
+    # The input events of a run in microseconds, given the clock
+    scale = 1 / (resolution / 1000000)
+    return {"trigger": inputs["trigger"] * scale, "events": [t * scale for t in inputs["events"]]}
 
-    return newData
+def format_segment(variance, measurement, time_units, burst=False, status=None, inputs=None, host=None):
+    lines = [f"variance = {variance} cycles\n"]
+    if host is not None:
+        # When the run came in, on the monotonic clock of the host
+        lines.append(f"host = {host} ns\n")
+    if status is not None:
+        lines.append("health: " + " ".join(f"{name}={value}" for (name, value) in status.items()) + "\n")
+    if inputs is not None:
+        # When the device sent the trigger and when the host kernel saw input
+        # events from it, in the time of the samples
+        lines.append(f"input: trigger={inputs['trigger']} events={','.join(str(t) for t in inputs['events'])}\n")
+    if burst:
+        lines.append(f"Time({time_units});Light(unitless);Report(flag)\n")
+        lines.extend(f"{x};{y};{r}\n" for (x, y, r) in measurement)
+    else:
+        lines.append(f"Time({time_units});Light(unitless)\n")
+        lines.extend(f"{x};{y}\n" for (x, y) in measurement)
+    return lines
+
+def format_run(sample, variance, measurement, time_units, burst=False, status=None, inputs=None, host=None, reset=None):
+    # reset is the (variance, measurement, status, inputs) of the reset step,
+    # if it was measured too
+    lines = [f"Measurement {sample}\n"]
+    lines.extend(format_segment(variance, measurement, time_units, burst, status, inputs, host))
+    if reset is not None:
+        lines.append("Reset\n")
+        lines.extend(format_segment(*reset[:2], time_units, False, *reset[2:]))
+    return "".join(lines)
+
+# What to send and how to measure it, the same for every tool that captures
+INPUT_OPTIONS = [
+    click.option("--input", "-i", "inputs", multiple=True, help="Input step to send, the last one is timed. Defaults to pressing a"),
+    click.option("--reset-input", "-r", "reset_inputs", multiple=True, help="Input step to send after each measurement"),
+    click.option("--burst", "-b", "keys", type=click.IntRange(0, 0xFFFF), default=0, help="Type a burst of n keys per sample, alternating the input and reset input"),
+    click.option("--rate", type=click.FloatRange(min=1, max=500), default=20, help="Keys per second in a burst"),
+    click.option("--time-reset", is_flag=True, help="Measure the first reset input too, the light going back"),
+    click.option("--trigger", type=click.IntRange(1, 1023), default=None, help="Only send the samples from when the light moved this many ADC counts"),
+    click.option("--pretrigger", type=click.IntRange(0, TRIGGER_MAX_PRETRIGGER), default=16, help="Samples to keep from before the light moved"),
+    click.option("--trigger-wait", type=click.IntRange(1, TRIGGER_MAX_WAIT), default=1000, help="Milliseconds to wait for the light to move"),
+]
+
+def input_options(f):
+    for option in reversed(INPUT_OPTIONS):
+        f = option(f)
+    return f
+
+def check_inputs(inputs, reset_inputs, keys=0, rate=20, time_reset=False, trigger=None, pretrigger=16, trigger_wait=1000):
+    # Returns the parsed steps, the time per key of a burst and the trigger
+    # for Device.configure. Raises a ValueError for options that don't go
+    # together
+    try:
+        steps = [hid.parse_step(x) for x in inputs]
+        steps.extend(hid.parse_step(x, reset=True) for x in reset_inputs)
+    except ValueError as e:
+        raise ValueError(f"Invalid input step: {e}")
+    if reset_inputs and not inputs:
+        raise ValueError("--reset-input needs an --input")
+    if time_reset and keys:
+        raise ValueError("--time-reset can't be used with --burst")
+    if time_reset and inputs and not reset_inputs:
+        raise ValueError("--time-reset needs a --reset-input")
+    if trigger is not None and keys:
+        raise ValueError("--trigger can't be used with --burst")
+    period = round(1000 / rate)
+    if keys * period > BURST_MAX_MS:
+        raise ValueError(f"--burst of {keys} keys at --rate {rate} takes longer than {BURST_MAX_MS}ms")
+    return (steps, period, None if trigger is None else (trigger, pretrigger, trigger_wait))
 
 @click.command()
-@click.option("--output", "-o", type=click.File("w"), default=sys.stdout, help="Write values to files instead of stdout")
+@click.option("--output", "-o", type=click.Path(dir_okay=False, allow_dash=True), default="-", help="Write values to files instead of stdout")
 @click.option("--delay", "-d", type=click.FLOAT, default=0, help="Wait n seconds before taking the measurement")
 @click.option("--samples", "-s", type=click.INT, default=1, help="Number of samples to take")
 @click.option("--convert", "-c", is_flag=True, help="Convert the time values to microseconds")
-def main(output, delay, samples, convert):
-    device = find_device()
-    serial = Serial(device)
-    handshake(serial)
-    keycodes(serial, 4, 42)
-    if convert:
-        (resolution,) = info(serial)
+@click.option("--live", is_flag=True, help="Plot the measurements while they are captured")
+@click.option("--resume", is_flag=True, help="Continue an interrupted capture in the output file")
+@click.option("--sync-every", type=click.INT, default=100, help="Sync the output to disk every n samples")
+@click.option("--device", default=None, help="Serial port or serial number of the device, the first one found by default")
+@click.option("--probe", "use_probe", is_flag=True, help="Timestamp the input events the host sees from the device, needs access to /dev/input")
+@input_options
+def main(output, delay, samples, convert, live, resume, sync_every, device, use_probe, inputs, reset_inputs, keys, rate, time_reset, trigger, pretrigger, trigger_wait):
+    if resume and output == "-":
+        raise click.UsageError("--resume needs an output file")
+    try:
+        (steps, period, trigger) = check_inputs(inputs, reset_inputs, keys, rate, time_reset, trigger, pretrigger, trigger_wait)
+    except ValueError as e:
+        raise click.UsageError(str(e))
+
+    probe = None
+    if use_probe:
+        from probe import Probe
+        try:
+            probe = Probe()
+        except Exception as e:
+            raise click.UsageError(f"Can't probe the host input: {e}")
 
     time_units = "us" if convert else "cycles"
 
-    for sample in range(0, samples):
-        time.sleep(delay)
-        (variance, measurement) = measure(serial)
-        if convert:
-            measurement = ts_to_us(resolution, measurement)
-
-        output.write(f"Measurement {sample}\n")
-        output.write(f"variance = {variance} cycles\n")
-        output.write(f"Time({time_units});Light(unitless)\n")
-        for (x, y) in measurement:
-            output.write(f"{x};{y}\n")
-        output.write("\n")
+    try:
+        view = None
+        if live:
+            # Only pull in matplotlib when we need it
+            from live import LiveView
+            view = LiveView(time_units)
+
+        try:
+            journal = open_journal(output, resume, sync_every)
+        except ValueError as e:
+            raise click.UsageError(str(e))
+        if journal.next_sample:
+            sys.stderr.write(f"Resuming at sample {journal.next_sample}\n")
+
+        async def capture_async():
+            async with frametime.Device(device, probe=probe) as dev:
+                resolution = await dev.configure(steps, convert, trigger)
+                if convert:
+                    sys.stderr.write(f"Clock at {resolution:.0f}Hz, {(resolution / F_CPU - 1) * 1e6:+.1f}ppm\n")
+                with journal:
+                    sample = journal.next_sample
+                    async for run in dev.runs(samples - journal.next_sample, delay, keys, period, time_reset):
+                        measurement = run.rows(resolution)
+                        events = run.inputs
+                        if convert and events is not None:
+                            events = inputs_to_us(resolution, events)
+
+                        journal.append(format_run(sample, run.variance, measurement, time_units, keys != 0, run.health, events, reset=run.segment(resolution)))
+                        sample += 1
+
+                        if view is not None:
+                            if keys:
+                                measurement = [(x, y) for (x, y, _) in measurement]
+                            view.feed(measurement)
+
+        def capture():
+            asyncio.run(capture_async())
+
+        if view is None:
+            capture()
+            return
+
+        # The plot has to live on the main thread, so move the capture out of
+        # the way
+        failure = []
+        def run():
+            try:
+                capture()
+            except Exception as e:
+                failure.append(e)
+
+        thread = threading.Thread(target=run, daemon=True)
+        thread.start()
+        view.run(thread)
+        thread.join()
+        if failure:
+            raise failure[0]
+    finally:
+        # Stops the thread reading the input events
+        if probe is not None:
+            probe.close()
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,134 @@
+#!/bin/python3
+
+import click
+import numpy as np
+import sys
+
+import analyze
+import filters
+
+# The shape of the response rather than just its timing. Every run of a capture
+# is shifted so its change lands at time 0, with sub-sample precision, and the
+# runs are then summarized sample by sample. Overdrive shows up as the curve
+# shooting past the new level, a compositor fade as a slow ramp.
+
+def change_times(times, values):
+    # When each run crosses half way from its old to its new level, like
+    # analyze_runs, but interpolated between the two samples around it
+    (old, new, values) = analyze.steady_levels(values)
+    middle = (old + new) / 2
+    after = np.maximum(np.argmax(values > middle[:, None], axis=1), 1)
+    rows = np.arange(len(values))
+
+    (t0, t1) = (times[rows, after - 1], times[rows, after])
+    (v0, v1) = (values[rows, after - 1], values[rows, after])
+    fraction = np.clip((middle - v0) / np.where(v1 != v0, v1 - v0, 1), 0, 1)
+    return t0 + (t1 - t0) * fraction
+
+def align(times, values, changes):
+    # Resample every run onto one grid around its change. The grid only
+    # reaches as far as every run does, so nothing has to be made up
+    n = times.shape[1]
+    step = (times[:, -1] - times[:, 0]) / (n - 1)
+    before = np.min(changes - times[:, 0])
+    after = np.min(times[:, -1] - changes)
+    spacing = np.median(step)
+    grid = np.arange(np.ceil(-before / spacing), np.floor(after / spacing) + 1) * spacing
+
+    position = (changes[:, None] + grid[None, :] - times[:, :1]) / step[:, None]
+    index = np.clip(np.floor(position).astype(int), 0, n - 2)
+    fraction = position - index
+    left = np.take_along_axis(values, index, axis=1)
+    right = np.take_along_axis(values, index + 1, axis=1)
+    return (grid, left + (right - left) * fraction)
+
+def normalize(grid, aligned, edge=.1):
+    # Scale every run so its old level is 0 and its new level 1. The old level
+    # is the average over the first half of the window before the change, the
+    # new one over the last edge of the window
+    start = aligned[:, grid <= grid[0] / 2].mean(axis=1)[:, None]
+    k = max(1, int(aligned.shape[1] * edge))
+    end = aligned[:, -k:].mean(axis=1)[:, None]
+    return (aligned - start) / np.where(end != start, end - start, 1)
+
+def summarize(aligned, band):
+    (low, median, high) = np.percentile(aligned, [band, 50, 100 - band], axis=0)
+    return {
+        "mean": aligned.mean(axis=0),
+        "median": median,
+        "low": low,
+        "high": high,
+    }
+
+def shape(grid, curve):
+    # Overshoot past the new level and the 10% to 90% rise of a normalized
+    # curve
+    begin = grid[np.argmax(curve > .1)]
+    end = grid[np.argmax(curve > .9)]
+    return (np.max(curve) - 1, end - begin)
+
+def response_curve(samples, filter_name, cutoff, band, raw):
+    (times, values) = filters.stack_runs(samples, analyze.linear_interp)
+    (times, values, _) = filters.apply(filter_name, times, values, samples[0].unit, cutoff)
+
+    (_, _, _, reject) = analyze.analyze_runs(times, values)
+    accepted = analyze.reject_unhealthy(samples, reject) == ""
+    if not np.any(accepted):
+        return None
+    (times, values) = (times[accepted], values[accepted])
+
+    (grid, aligned) = align(times, values, change_times(times, values))
+    if not raw:
+        aligned = normalize(grid, aligned)
+    return (grid, summarize(aligned, band), np.count_nonzero(accepted))
+
+@click.command()
+@click.argument("data", nargs=-1)
+@click.option("--output", "-o", type=click.File("w"), default=sys.stdout, help="Write the curves to a file instead of stdout")
+@click.option("--filter", "-f", "filter_name", type=click.Choice(filters.FILTERS), default="average", help="Filter applied to the light level before aligning")
+@click.option("--cutoff", type=float, default=None, help="Lowpass cutoff in Hz, defaults to below the detected backlight PWM")
+@click.option("--band", type=click.FloatRange(0, 50), default=5, help="Percentile of the lower edge of the band, the upper edge is 100 minus this")
+@click.option("--raw", is_flag=True, help="Keep the light levels as measured instead of scaling every run from 0 to 1")
+@click.option("--plot", is_flag=True, help="Plot the curves")
+def main(data, output, filter_name, cutoff, band, raw, plot):
+    args = [analyze.InputArg(x) for x in data]
+
+    for arg in args:
+        if arg.path.exists() and arg.path.is_file():
+            continue
+
+        sys.stderr.write(f"{arg.path}: file does not exist\n")
+        exit(1)
+
+    curves = []
+    unit = None
+    for arg in args:
+        with open(arg.path, "r") as f:
+            samples = analyze.read_measurements(f)
+        result = response_curve(samples, filter_name, cutoff, band, raw)
+        if result is None:
+            raise Exception(f"{arg.title}: no significant difference in light level")
+        (grid, curve, count) = result
+        unit = samples[0].unit
+        curves.append((arg.title, grid, curve))
+
+        if not raw:
+            (overshoot, rise) = shape(grid, curve["mean"])
+            sys.stderr.write(f"{arg.title}: {count} runs, overshoot {overshoot:+.1%}, rise {rise:.3f}\n")
+
+    output.write(f"title;time({unit});mean;median;p{band:g};p{100 - band:g}\n")
+    for (title, grid, curve) in curves:
+        output.writelines(f"{title};{t};{a};{m};{l};{h}\n" for (t, a, m, l, h) in zip(grid, curve["mean"], curve["median"], curve["low"], curve["high"]))
+
+    if plot:
+        import matplotlib.pyplot as plt
+        for (title, grid, curve) in curves:
+            line = plt.plot(grid, curve["mean"], label=title)[0]
+            plt.fill_between(grid, curve["low"], curve["high"], color=line.get_color(), alpha=.2)
+        plt.xlabel(f"Time from the change ({unit})")
+        plt.ylabel("Light (unitless)" if raw else "Response")
+        plt.legend()
+        plt.show()
+
+if __name__ == "__main__":
+    main()
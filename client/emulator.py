@@ -0,0 +1,117 @@
+#!/bin/python3
+
+import click
+import fcntl
+import os
+import select
+import signal
+import struct
+import sys
+import termios
+import time
+import tty
+
+import client
+import simulator
+
+# Serves a simulated device on a pseudo terminal, so client.py and the others
+# can be pointed at it with --device. The device greets the host when DTR goes
+# up, there's no DTR on a pty, but pyserial flushes the input when it opens the
+# port, which packet mode lets us see.
+
+# Seconds between monitor blocks going out, about as often as the device sends
+# them
+MONITOR_POLL = .005
+
+def serve(device, master):
+    pending = bytearray()
+    # When the monitoring started, it keeps up with the wall clock
+    monitoring = None
+    while True:
+        writing = [master] if pending else []
+        timeout = MONITOR_POLL if device.monitoring else None
+        (readable, writable, _) = select.select([master], writing, [], timeout)
+
+        if device.monitoring:
+            if monitoring is None:
+                monitoring = time.monotonic()
+            samples = (time.monotonic() - monitoring) * simulator.F_CPU / client.MONITOR_SAMPLE_CYCLES
+            due = int(samples) // client.MONITOR_BLOCK - device.monitor_sample // client.MONITOR_BLOCK
+            if due > 0:
+                device.monitor(due)
+                pending += device.read(len(device.output))
+        else:
+            monitoring = None
+
+        if readable:
+            try:
+                packet = os.read(master, 4096)
+            except OSError:
+                # The other side closed, wait for the next one
+                packet = b""
+            if not packet:
+                continue
+            if packet[0] == termios.TIOCPKT_DATA:
+                device.write(packet[1:])
+            elif packet[0] & termios.TIOCPKT_FLUSHREAD:
+                # Someone opened the port. Anything left over was for the last
+                # one
+                pending.clear()
+                device.output.clear()
+                device.connect()
+            pending += device.read(len(device.output))
+
+        if writable:
+            try:
+                written = os.write(master, pending[:4096])
+            except BlockingIOError:
+                written = 0
+            del pending[:written]
+
+@click.command()
+@click.option("--link", "-l", type=click.Path(dir_okay=False), default=None, help="Symlink the pty here")
+@click.option("--truth", "-t", type=click.File("w"), default=None, help="Write the change time of every measurement, in cycles like analyze.py")
+@click.option("--seed", type=click.INT, default=None, help="Seed for the simulated measurements")
+@click.option("--lag", type=click.FLOAT, default=.02, help="Seconds from the key until the application has drawn it")
+@click.option("--jitter", type=click.FLOAT, default=.002, help="Spread of the lag in seconds")
+@click.option("--distribution", type=click.Choice(simulator.DISTRIBUTIONS), default="uniform", help="How the jitter is spread")
+@click.option("--refresh", type=click.FLOAT, default=60, help="Refresh rate of the display in Hz, 0 to show it right away")
+@click.option("--rise", type=click.FLOAT, default=.002, help="Seconds the display takes from 10% to 90%")
+@click.option("--shape", type=click.Choice(simulator.SHAPES), default="linear", help="Shape of the rise")
+@click.option("--pwm", type=click.FLOAT, default=0, help="Backlight PWM frequency in Hz, 0 for none")
+@click.option("--pwm-depth", type=click.FLOAT, default=.1, help="How far the PWM dims the light")
+@click.option("--noise", type=click.FLOAT, default=3, help="Standard deviation of the noise in ADC counts")
+@click.option("--stutter", type=click.FloatRange(0, 1), default=.01, help="Fraction of the frames of the monitored animation that miss a refresh")
+@click.option("--clock", type=click.FLOAT, default=simulator.F_CPU, help="Clock of the device in Hz as measured against USB")
+def main(link, truth, seed, clock, **model):
+    device = simulator.SimulatedDevice(simulator.Model(**model), seed=seed, hello=False, clock=clock)
+    if truth is not None:
+        def record(changetime):
+            truth.write(f"{changetime:.0f}\n")
+            truth.flush()
+        device.truth = record
+
+    (master, slave) = os.openpty()
+    tty.setraw(slave)
+    fcntl.ioctl(master, termios.TIOCPKT, struct.pack("i", 1))
+    os.set_blocking(master, False)
+    path = os.ttyname(slave)
+
+    if link is not None:
+        if os.path.lexists(link):
+            os.unlink(link)
+        os.symlink(path, link)
+    sys.stderr.write(f"Emulating the device on {path}\n")
+    # Clean up the link when we get killed too
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+
+    try:
+        serve(device, master)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if link is not None:
+            os.unlink(link)
+
+if __name__ == "__main__":
+    main()
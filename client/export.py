@@ -0,0 +1,137 @@
+#!/bin/python3
+
+import click
+import numpy as np
+import pyarrow as pa
+import pyarrow.parquet as pq
+import sys
+
+import analyze
+import filters
+
+# Writes the per-run results of analyze.py, and optionally the raw traces, to
+# Parquet. Every capture becomes a row group of its own, so a reader only
+# interested in a few captures can skip the rest. Titles and other repeated
+# strings are dictionary encoded.
+
+def text():
+    return pa.dictionary(pa.int32(), pa.string())
+
+RUNS = pa.schema([
+    ("title", text()),
+    ("capture", text()),
+    ("filter", text()),
+    ("unit", text()),
+    # "trigger", or "reset" for the light going back after the reset step
+    ("segment", text()),
+    ("run", pa.int32()),
+    ("variance", pa.int32()),
+    ("changetime", pa.float64()),
+    ("risetime", pa.float64()),
+    ("delta", pa.float64()),
+    # Null for runs that were used
+    ("reject", text()),
+    ("pwm", pa.float64()),
+    ("poll_latency", pa.float64()),
+    ("period_error", pa.float64()),
+    ("usb", pa.float64()),
+    ("host", pa.float64()),
+])
+
+TRACES = pa.schema([
+    ("title", text()),
+    ("capture", text()),
+    ("unit", text()),
+    # Like in RUNS
+    ("segment", text()),
+    ("run", pa.int32()),
+    ("time", pa.list_(pa.float64())),
+    ("value", pa.list_(pa.uint16())),
+    # Only for bursts
+    ("report", pa.list_(pa.bool_())),
+])
+
+def repeat(value, n):
+    return pa.array([value] * n, pa.string()).dictionary_encode()
+
+def nullable(values):
+    # nan is how analyze.py says it doesn't know
+    values = np.asarray(values, dtype=float)
+    return pa.array(values, mask=np.isnan(values))
+
+def runs_table(title, path, filter_name, results, segment="trigger"):
+    n = len(results["changetimes"])
+    reject = results["reject"].astype(str)
+    return pa.Table.from_arrays([
+        repeat(title, n),
+        repeat(str(path), n),
+        repeat(filter_name, n),
+        repeat(str(results["unit"]), n),
+        repeat(segment, n),
+        pa.array(results["runs"], pa.int32()),
+        pa.array(results["variances"], pa.int32()),
+        nullable(results["changetimes"]),
+        nullable(results["risetimes"]),
+        nullable(results["deltas"]),
+        pa.array(reject, mask=reject == "").dictionary_encode(),
+        nullable(results["pwm"]),
+        nullable(results["poll_latency"]),
+        nullable(results["period_error"]),
+        nullable(results["usb"]),
+        nullable(results["host"]),
+    ], schema=RUNS)
+
+def traces_table(title, path, samples, segment="trigger"):
+    n = len(samples)
+    return pa.Table.from_arrays([
+        repeat(title, n),
+        repeat(str(path), n),
+        pa.array([s.unit for s in samples], pa.string()).dictionary_encode(),
+        repeat(segment, n),
+        pa.array([s.number for s in samples], pa.int32()),
+        pa.array([s.times for s in samples], pa.list_(pa.float64())),
+        pa.array([s.values for s in samples], pa.list_(pa.uint16())),
+        pa.array([[bool(r) for r in s.reports] if s.reports is not None else None for s in samples], pa.list_(pa.bool_())),
+    ], schema=TRACES)
+
+@click.command()
+@click.argument("data", nargs=-1)
+@click.option("--output", "-o", type=click.Path(dir_okay=False), required=True, help="Parquet file to write the per-run results to")
+@click.option("--traces", type=click.Path(dir_okay=False), default=None, help="Also write the raw traces to this Parquet file")
+@click.option("--filter", "-f", "filter_name", type=click.Choice(filters.FILTERS), default="average", help="Filter applied to the light level before finding the edges")
+@click.option("--cutoff", type=float, default=None, help="Lowpass cutoff in Hz, defaults to below the detected backlight PWM")
+@click.option("--cache/--no-cache", "use_cache", default=True, help="Reuse the per-run results of captures analyzed before")
+@click.option("--compression", type=click.Choice(["zstd", "snappy", "gzip", "none"]), default="zstd", help="Compression of the columns")
+def main(data, output, traces, filter_name, cutoff, use_cache, compression):
+    args = [analyze.InputArg(x) for x in data]
+    for arg in args:
+        if not (arg.path.exists() and arg.path.is_file()):
+            sys.stderr.write(f"{arg.path}: file does not exist\n")
+            exit(1)
+
+    runs_writer = pq.ParquetWriter(output, RUNS, compression=compression)
+    traces_writer = pq.ParquetWriter(traces, TRACES, compression=compression) if traces is not None else None
+    try:
+        for arg in args:
+            results = analyze.load_results(arg.path, filter_name, cutoff, use_cache)
+            table = runs_table(arg.title, arg.path, filter_name, results)
+            reset = analyze.reset_results(results)
+            if reset is not None:
+                table = pa.concat_tables([table, runs_table(arg.title, arg.path, filter_name, reset, "reset")]).unify_dictionaries()
+            runs_writer.write_table(table)
+
+            if traces_writer is not None:
+                with open(arg.path, "r") as f:
+                    samples = analyze.read_measurements(f)
+                table = traces_table(arg.title, arg.path, samples)
+                resets = [s.reset for s in samples if s.reset is not None]
+                if resets:
+                    table = pa.concat_tables([table, traces_table(arg.title, arg.path, resets, "reset")]).unify_dictionaries()
+                traces_writer.write_table(table)
+    finally:
+        runs_writer.close()
+        if traces_writer is not None:
+            traces_writer.close()
+
+if __name__ == "__main__":
+    main()
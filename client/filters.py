@@ -0,0 +1,177 @@
+import numpy as np
+import scipy.signal as signal
+import scipy.ndimage as ndimage
+
+# Seconds per time unit as written in the measurement header. Cycles assume the
+# stock 16MHz teensy
+UNIT_SECONDS = {
+    "us": 1e-6,
+    "cycles": 1 / 16000000,
+}
+
+FILTERS = ["average", "lowpass", "notch", "median"]
+
+# Backlight PWM tends to live between a few hundred Hz and a few kHz. Anything
+# outside that band is more likely to be the transition itself or noise
+PWM_MIN_HZ = 90
+PWM_MAX_HZ = 8000
+# How much louder than the typical bin the peak has to be before we call it PWM
+PWM_PROMINENCE = 40
+
+def moving_average(a, n=5):
+    ret = np.cumsum(a, axis=-1, dtype=float)
+    ret[..., n:] = ret[..., n:] - ret[..., :-n]
+    return ret[..., n - 1:] / n
+
+def stack_runs(samples, interp):
+    # Put every run on its own uniform grid and stack them into one 2D array.
+    # All runs are sampled by the same loop on the device, so they only differ
+    # in length by a sample or two
+    grids = [interp(np.array(s.times), np.array(s.values)) for s in samples]
+    n = min(len(x) for (x, _) in grids)
+    times = np.stack([x[:n] for (x, _) in grids])
+    values = np.stack([y[:n] for (_, y) in grids])
+    return (times, values)
+
+def sample_rate(times, unit):
+    # Sample rate (Hz) of each run
+    dt = (times[:, -1] - times[:, 0]) / (times.shape[1] - 1)
+    return 1 / (dt * UNIT_SECONDS[unit])
+
+def idle_mask(values, margin=16):
+    # Mark the parts of each run where the light level is steady, that is
+    # before the response starts and after it has settled. Find the response
+    # on a coarse average since the ripple is what we are trying to get rid of.
+    # Runs too short for that have no steady parts
+    if values.shape[1] < 2 * 33:
+        return (np.zeros(values.shape, dtype=bool), np.zeros(values.shape, dtype=bool))
+    coarse = moving_average(values, 33)
+    pad = values.shape[1] - coarse.shape[1]
+    coarse = np.pad(coarse, ((0, 0), (pad // 2, pad - pad // 2)), mode="edge")
+
+    start = coarse[:, pad][:, None]
+    rise = coarse[:, -pad - 1][:, None] - start
+    high = rise >= 0
+    above = np.where(high, coarse > start + rise * .1, coarse < start + rise * .1)
+    below = np.where(high, coarse < start + rise * .9, coarse > start + rise * .9)
+
+    n = values.shape[1]
+    begin = np.argmax(above, axis=1)
+    # Last sample that hasn't reached 90% yet
+    end = n - 1 - np.argmax(below[:, ::-1], axis=1)
+
+    index = np.arange(n)[None, :]
+    before = index < (begin - margin)[:, None]
+    after = index > (end + margin)[:, None]
+    return (before, after)
+
+def detect_pwm(values, rate):
+    # Returns the strongest periodic component (Hz) of the idle parts of each
+    # run, or nan if there is no clear peak
+    (before, after) = idle_mask(values)
+    idle = before | after
+
+    # Fit a line through each of the two idle segments and subtract it, so
+    # neither the level difference nor the tail of the response shows up as
+    # a low frequency peak
+    index = np.arange(values.shape[1])[None, :]
+    def detrend(mask):
+        count = np.maximum(mask.sum(axis=1), 1)[:, None]
+        x = np.where(mask, index, 0)
+        y = np.where(mask, values, 0)
+        mx = x.sum(axis=1)[:, None] / count
+        my = y.sum(axis=1)[:, None] / count
+        dx = np.where(mask, index - mx, 0)
+        slope = (dx * (y - my)).sum(axis=1)[:, None] / np.maximum((dx * dx).sum(axis=1)[:, None], 1)
+        return np.where(mask, values - my - slope * (index - mx), 0)
+
+    ripple = detrend(before) + detrend(after)
+
+    nfft = 1 << int(np.ceil(np.log2(values.shape[1] * 4)))
+    power = np.abs(np.fft.rfft(ripple, n=nfft, axis=1)) ** 2
+    bins = np.fft.rfftfreq(nfft)[None, :] * rate[:, None]
+
+    # Compare each bin to its neighbourhood rather than the whole spectrum. The
+    # response tail that survives the detrend leaks into a broad hump at the
+    # low end, while PWM shows up as narrow spikes
+    floor = ndimage.median_filter(power, size=(1, 129), mode="nearest")
+    prominence = power / np.maximum(floor, 1e-9)
+
+    band = (bins >= PWM_MIN_HZ) & (bins <= PWM_MAX_HZ)
+    prominence = np.where(band, prominence, 0)
+    peak = np.argmax(prominence, axis=1)
+    rows = np.arange(len(peak))
+
+    freq = bins[rows, peak]
+    valid = (prominence[rows, peak] > PWM_PROMINENCE) & (idle.sum(axis=1) > 16)
+    return np.where(valid, freq, np.nan)
+
+def capture_pwm(pwm):
+    # The PWM of the whole capture, nan unless it showed up in most runs. A
+    # few runs with noise that happens to look periodic shouldn't decide how
+    # all of them are filtered
+    if np.sum(np.isfinite(pwm)) * 2 <= len(pwm):
+        return np.nan
+    return np.nanmedian(pwm)
+
+def lowpass(values, rate, pwm, cutoff=None):
+    # Zero phase butterworth over all runs at once. Without an explicit cutoff
+    # we stay an octave below the PWM
+    fs = np.median(rate)
+    if cutoff is None:
+        cutoff = capture_pwm(pwm) / 2 if np.isfinite(capture_pwm(pwm)) else 1000
+    cutoff = min(cutoff, fs * .45)
+    sos = signal.butter(4, cutoff, fs=fs, output="sos")
+    return signal.sosfiltfilt(sos, values, axis=1)
+
+def notch(values, rate, pwm, width=.1):
+    # Remove the PWM fundamental and its harmonics from each run in the
+    # frequency domain. Every run gets its own notch frequency. The response is
+    # a step, so take the ramp between the end points out first, otherwise the
+    # wrap-around edge leaks into every bin
+    n = values.shape[1]
+    ramp = np.linspace(0, 1, n)[None, :] * (values[:, -1] - values[:, 0])[:, None]
+    ramp += values[:, 0][:, None]
+
+    spectrum = np.fft.rfft(values - ramp, axis=1)
+    bins = np.fft.rfftfreq(n)[None, :] * rate[:, None]
+
+    f0 = np.nan_to_num(pwm, nan=0)[:, None]
+    # Square wave PWM has harmonics all the way up, so notch every one of them
+    # below nyquist
+    harmonics = int(np.max(rate) / 2 / capture_pwm(pwm)) if np.isfinite(capture_pwm(pwm)) else 0
+    gain = np.ones(spectrum.shape)
+    for h in range(1, harmonics + 1):
+        centre = f0 * h
+        bw = np.maximum(centre * width, 2 * rate[:, None] / n)
+        gain *= 1 - np.exp(-((bins - centre) / bw) ** 2) * (f0 > 0)
+
+    return np.fft.irfft(spectrum * gain, n=n, axis=1) + ramp
+
+def median(values, rate, pwm):
+    # A median window covering one PWM period flattens the ripple without
+    # smearing the edge like an average would
+    period = np.median(rate) / capture_pwm(pwm) if np.isfinite(capture_pwm(pwm)) else 5
+    size = int(np.ceil(period)) | 1
+    return ndimage.median_filter(values, size=(1, size), mode="nearest")
+
+def apply(name, times, values, unit, cutoff=None):
+    # Returns the filtered (times, values), and the PWM frequency found in each
+    # run
+    rate = sample_rate(times, unit)
+    pwm = detect_pwm(values, rate)
+
+    if name == "average":
+        values = moving_average(values)
+        # The moving average discards the ends of the values to reduce error
+        times = times[:, 2:-2]
+    elif name == "lowpass":
+        values = lowpass(values, rate, pwm, cutoff)
+    elif name == "notch":
+        values = notch(values, rate, pwm)
+    elif name == "median":
+        values = median(values, rate, pwm)
+    else:
+        raise Exception(f"Unknown filter {name}")
+
+    return (times, values, pwm)
@@ -0,0 +1,488 @@
+import asyncio
+import collections
+import os
+import struct
+import sys
+import time
+import numpy as np
+from serial import Serial
+
+import client
+import hid
+
+# Talks to the device from an asyncio event loop, for embedding measurements in
+# other programs. The serial port is read by the loop as data comes in, so any
+# number of devices can be driven from one thread.
+#
+#     async with Device() as device:
+#         await device.configure([hid.parse_step("a")])
+#         async for run in device.runs(100):
+#             print(run.times, run.values)
+#
+# The records of a run are copied out of the read buffer once and decoded
+# straight from those bytes. Where the samples are in one piece, which is always
+# the case with the current firmware, values are a view into them instead of
+# another copy.
+
+# Any 32 bit word at or above this is one of the terminators
+TERMINATOR = 0xFFFFFFFE
+# Seconds between monitor blocks going out of the simulated device, about as
+# often as the device sends them
+MONITOR_POLL = .005
+
+class Stream(object):
+    # Buffers what the device sent, and remembers when every chunk of it came
+    # in for lining up with the probe
+    def __init__(self):
+        self.buffer = bytearray()
+        # Where every chunk ends, counted from the start of the stream, and
+        # the monotonic time in ns it was read at
+        self.chunks = collections.deque()
+        self.consumed = 0
+        self.waiter = None
+        self.error = None
+
+    def feed(self, chunk):
+        self.buffer += chunk
+        self.chunks.append((self.consumed + len(self.buffer), time.monotonic_ns()))
+        self.wake()
+
+    def fail(self, error):
+        self.error = error
+        self.wake()
+
+    def wake(self):
+        if self.waiter is not None and not self.waiter.done():
+            self.waiter.set_result(None)
+
+    async def wait(self):
+        if self.error is not None:
+            raise self.error
+        self.waiter = asyncio.get_running_loop().create_future()
+        await self.waiter
+        self.waiter = None
+        if self.error is not None:
+            raise self.error
+
+    def take(self, n):
+        with memoryview(self.buffer) as view:
+            data = bytes(view[:n])
+        del self.buffer[:n]
+        self.consumed += n
+        while self.chunks and self.chunks[0][0] <= self.consumed:
+            self.chunks.popleft()
+        return data
+
+    def arrivals(self, ends):
+        # When the bytes ending at ends, counted from the start of the stream,
+        # were read
+        chunks = np.array(self.chunks, dtype=np.int64).reshape(-1, 2)
+        return chunks[np.searchsorted(chunks[:, 0], ends), 1]
+
+    async def read(self, n):
+        while len(self.buffer) < n:
+            await self.wait()
+        return self.take(n)
+
+    async def read_records(self):
+        # Reads records up to the terminator. Returns whether the device
+        # reported success, the records and when each of them was read. Only
+        # the words that came in since the last look are checked, in place.
+        # Nothing may hold on to a view of the buffer while waiting, it can't
+        # grow then
+        checked = 0
+        while True:
+            count = len(self.buffer) // 4
+            if count > checked:
+                found = np.flatnonzero(np.frombuffer(self.buffer, ">u4", count - checked, 4 * checked) >= TERMINATOR)
+                if len(found):
+                    end = checked + found[0]
+                    break
+                checked = count
+            await self.wait()
+
+        arrivals = self.arrivals(self.consumed + 4 * np.arange(1, end + 1))
+        data = self.take(4 * end)
+        terminator = self.take(4)
+        return (terminator == client.SUCCESS, data, arrivals)
+
+    async def read_blocks(self):
+        # Reads the monitor blocks that are in, waiting for at least one.
+        # Returns their bytes, and whether the stream ended after them
+        size = client.MONITOR_BLOCK_BYTES
+        sync = struct.pack("!H", client.MONITOR_SYNC)
+        while True:
+            count = len(self.buffer) // size
+            # The first word of every block, checked in place
+            bad = np.flatnonzero(np.frombuffer(self.buffer, ">u2", count * size // 2)[::size // 2] != client.MONITOR_SYNC)
+            whole = bad[0] if len(bad) else count
+            if whole:
+                return (self.take(whole * size), False)
+            # Nothing whole at the front, that's the terminator or more to come
+            if len(self.buffer) >= 4 and self.buffer[:2] == b"\xFF\xFF":
+                if self.take(4) != client.SUCCESS:
+                    raise Exception("Monitoring failed")
+                return (b"", True)
+            if len(self.buffer) >= 2 and self.buffer[:2] not in (sync, b"\xFF\xFF"):
+                raise Exception("Lost track of the monitor blocks")
+            await self.wait()
+
+class SerialStream(Stream):
+    def __init__(self, port):
+        super().__init__()
+        self.serial = Serial(port, timeout=0)
+        self.fd = self.serial.fileno()
+        self.loop = asyncio.get_running_loop()
+        self.loop.add_reader(self.fd, self.readable)
+
+    def readable(self):
+        try:
+            chunk = os.read(self.fd, 1 << 16)
+        except BlockingIOError:
+            return
+        except OSError as e:
+            self.loop.remove_reader(self.fd)
+            self.fail(e)
+            return
+        if not chunk:
+            self.loop.remove_reader(self.fd)
+            self.fail(EOFError("The device went away"))
+            return
+        self.feed(chunk)
+
+    def write(self, data):
+        self.serial.write(data)
+
+    def close(self):
+        self.loop.remove_reader(self.fd)
+        self.serial.close()
+
+class SimulatedStream(Stream):
+    # In front of a simulator.SimulatedDevice, which answers as soon as it's
+    # written to
+    def __init__(self, device):
+        super().__init__()
+        self.device = device
+        # When the monitoring started, it keeps up with the loop clock
+        self.monitoring = None
+        self.feed(device.read(len(device.output)))
+
+    def write(self, data):
+        self.device.write(data)
+        if not self.device.monitoring:
+            self.monitoring = None
+        self.feed(self.device.read(len(self.device.output)))
+
+    async def wait(self):
+        # A monitoring device never runs out of samples, but only has as many
+        # as the real one would have taken by now
+        if not self.device.monitoring:
+            raise Exception("The simulated device has nothing more to say")
+        loop = asyncio.get_running_loop()
+        if self.monitoring is None:
+            self.monitoring = loop.time()
+        await asyncio.sleep(MONITOR_POLL)
+        samples = (loop.time() - self.monitoring) * client.F_CPU / client.MONITOR_SAMPLE_CYCLES
+        due = int(samples) // client.MONITOR_BLOCK - self.device.monitor_sample // client.MONITOR_BLOCK
+        if due > 0 and self.device.monitoring:
+            self.device.monitor(due)
+            self.feed(self.device.read(len(self.device.output)))
+
+    def close(self):
+        self.device.close()
+
+class Run(object):
+    # One measurement. times are in device cycles, relative to the first
+    # sample for a single key and to the first key for a burst. reports is
+    # only set for bursts, True where a report went out with the sample. health
+    # is what client.health makes of the telemetry, inputs the input events
+    # from the probe in the time of the samples and the time of the trigger.
+    # reset is the Run of the reset step, if it was measured too
+    def __init__(self, variance, times, values, reports=None, health=None, inputs=None, reset=None):
+        self.variance = variance
+        self.times = times
+        self.values = values
+        self.reports = reports
+        self.health = health
+        self.inputs = inputs
+        self.reset = reset
+
+    def rows(self, resolution=None):
+        # The records as (time, value) tuples, or (time, value, report) for
+        # a burst, like client.format_run takes them. The times are in
+        # microseconds if given the clock
+        times = self.times if resolution is None else self.times * (1000000 / resolution)
+        if self.reports is None:
+            return list(zip(times.tolist(), self.values.tolist()))
+        return list(zip(times.tolist(), self.values.tolist(), self.reports.astype(int).tolist()))
+
+    def segment(self, resolution=None):
+        # The reset the way client.format_run takes it
+        if self.reset is None:
+            return None
+        inputs = self.reset.inputs
+        if resolution is not None and inputs is not None:
+            inputs = client.inputs_to_us(resolution, inputs)
+        return (self.reset.variance, self.reset.rows(resolution), self.reset.health, inputs)
+
+def decode(data):
+    # Times and values of the samples in a stream, and the telemetry by name.
+    # The time of every record is the lower half, the upper half comes from the
+    # last TIME_HIGH record plus the times the lower half wrapped since. The
+    # samples from before a trigger come last, they are put back in order
+    records = np.frombuffer(data, ">u2").reshape(-1, 2)
+    kind = records[:, 1]
+    telemetry = np.isin(kind, list(client.TELEMETRY))
+    high = kind == client.TIME_HIGH
+    samples = np.flatnonzero(~telemetry & ~high)
+
+    # Which TIME_HIGH every sample comes after, -1 for none
+    marks = np.where(high, np.arange(len(records)), -1)
+    segment = np.maximum.accumulate(marks)[samples]
+    base = np.where(segment >= 0, records[np.maximum(segment, 0), 0].astype(np.int64), 0)
+
+    low = records[samples, 0].astype(np.int64)
+    wrapped = np.concatenate(([0], np.cumsum((low[1:] < low[:-1]) & (segment[1:] == segment[:-1]))))
+    # Count the wraps from the start of every segment
+    first = np.searchsorted(segment, segment)
+    times = ((base + wrapped - wrapped[first]) << 16) | low
+
+    if len(samples) and samples[-1] - samples[0] + 1 == len(samples):
+        values = records[samples[0]:samples[-1] + 1, 1]
+    else:
+        values = records[samples, 1]
+
+    if np.any(times[1:] < times[:-1]):
+        order = np.argsort(times, kind="stable")
+        (times, values, samples) = (times[order], values[order], samples[order])
+
+    found = {client.TELEMETRY[int(k)]: int(t) for (t, k) in records[telemetry]}
+    return (times, values, samples, found)
+
+def unpack_blocks(data):
+    # The times of the first sample and the values of whole monitor blocks,
+    # the values as a (blocks, MONITOR_BLOCK) array
+    blocks = np.frombuffer(data, np.uint8).reshape(-1, client.MONITOR_BLOCK_BYTES)
+    times = np.ascontiguousarray(blocks[:, 2:6]).view(">u4")[:, 0].astype(np.int64)
+    groups = blocks[:, 6:].reshape(len(blocks), -1, 5).astype(np.uint16)
+    low = (groups[:, :, 4:] >> np.array([6, 4, 2, 0], dtype=np.uint16)) & 3
+    values = ((groups[:, :, :4] << 2) | low).reshape(len(blocks), -1)
+    return (times, values)
+
+def pack_blocks(times, values):
+    # The bytes the device sends for the blocks, the other way around
+    blocks = len(times)
+    header = np.zeros((blocks, 6), dtype=np.uint8)
+    header[:, :2] = np.frombuffer(struct.pack("!H", client.MONITOR_SYNC), np.uint8)
+    header[:, 2:] = (np.asarray(times) & 0xFFFFFFFF).astype(">u4").view(np.uint8).reshape(blocks, 4)
+    groups = np.asarray(values, dtype=np.uint16).reshape(blocks, -1, 4)
+    low = ((groups & 3) << np.array([6, 4, 2, 0], dtype=np.uint16)).sum(axis=2)
+    packed = np.concatenate([groups >> 2, low[:, :, None]], axis=2).reshape(blocks, -1)
+    return np.concatenate([header, packed.astype(np.uint8)], axis=1).tobytes()
+
+def split_segments(data):
+    # The records of the first segment, and the variance and records of the
+    # reset segment or None
+    kind = np.frombuffer(data, ">u2")[1::2]
+    found = np.flatnonzero(kind == client.SEGMENT_RESET)
+    if not len(found):
+        return (data, None, None)
+    start = 4 * found[0]
+    (variance,) = struct.unpack("!H", data[start:start + 2])
+    return (data[:start], variance, data[start + 4:])
+
+class Device(object):
+    # port is the serial port or serial number, the first device found if
+    # None. stream replaces the serial port altogether, like a SimulatedStream.
+    # probe is a probe.Probe to line the host input events up with the runs
+    def __init__(self, port=None, stream=None, probe=None):
+        self.port = port
+        self.stream = stream
+        self.probe = probe
+        self.seq = 0
+        self.pending = collections.deque()
+
+    async def __aenter__(self):
+        if self.stream is None:
+            self.stream = SerialStream(client.open_device(self.port))
+        try:
+            await self.handshake()
+        except BaseException:
+            self.stream.close()
+            raise
+        return self
+
+    async def __aexit__(self, *exc):
+        self.stream.close()
+
+    def send(self, op, payload=b""):
+        # seq 0 is used by the greeting, so skip it
+        self.seq = self.seq % 255 + 1
+        self.stream.write(bytes((client.FRAME_COMMAND, self.seq, op, len(payload))) + payload)
+        self.pending.append((self.seq, op))
+
+    async def receive(self):
+        header = await self.stream.read(client.FRAME_HEADER_RESPONSE)
+        if header[0] != client.FRAME_RESPONSE:
+            raise Exception("Expected a response from the device")
+        (_, seq, op, status, length) = header
+        payload = await self.stream.read(length)
+        return (seq, op, status, payload)
+
+    async def answer(self, op):
+        (seq, sent) = self.pending.popleft()
+        assert(sent == op)
+        (rseq, rop, status, payload) = await self.receive()
+        if rseq != seq or rop != op:
+            raise Exception(f"Expected a response to {chr(op)}, got {chr(rop)}")
+        return (status, payload)
+
+    async def accepted(self, op, error):
+        (status, payload) = await self.answer(op)
+        if status != client.STATUS_ACCEPT:
+            raise Exception(error)
+        return payload
+
+    async def handshake(self):
+        (seq, op, status, payload) = await self.receive()
+        if op != client.OP_HELLO or not payload.startswith(b"ScreenTimer"):
+            raise Exception("Device did not greet us, is this a ScreenTimer?")
+
+    async def info(self):
+        self.send(client.OP_INFO)
+        (resolution,) = struct.unpack("!I", await self.accepted(client.OP_INFO, "Incorrect info response"))
+        return resolution
+
+    async def clock(self, frames=None):
+        # The clock measured against USB in Hz, None if the device couldn't
+        frames = frames or client.CLOCK_FRAMES
+        self.send(client.OP_CLOCK, struct.pack("!H", frames))
+        (status, payload) = await self.answer(client.OP_CLOCK)
+        if status != client.STATUS_ACCEPT:
+            return None
+        (cycles,) = struct.unpack("!I", payload)
+        return cycles * 1000 / frames
+
+    async def configure(self, steps=(), convert=False, trigger=None):
+        # Sets up the input, pressing a and then backspace without any steps.
+        # trigger is (threshold, pretrigger, wait in ms) to hold the samples
+        # back until the light moves, see OP_TRIGGER. If convert, returns the
+        # clock to convert times with, measured if the device can and nominal
+        # otherwise
+        if steps:
+            for (index, step) in enumerate(steps):
+                self.send(client.OP_SEQUENCE, hid.encode(index, step))
+            for _ in steps:
+                await self.accepted(client.OP_SEQUENCE, "Input sequence not accepted")
+        else:
+            self.send(client.OP_KEYCODES, bytes((4, 42)))
+            await self.accepted(client.OP_KEYCODES, "Keycode not accepted")
+        if trigger is not None:
+            self.send(client.OP_TRIGGER, struct.pack("!HBH", *trigger))
+            await self.accepted(client.OP_TRIGGER, "Trigger not accepted")
+        if not convert:
+            return None
+        resolution = await self.info()
+        measured = await self.clock()
+        if measured is None:
+            sys.stderr.write(f"Couldn't measure the clock, assuming {resolution}Hz\n")
+            return resolution
+        return measured
+
+    async def calibrate(self):
+        # Times and values of the light as fast as the device can sample it
+        self.send(client.OP_CALIBRATE)
+        await self.accepted(client.OP_CALIBRATE, "Calibration rejected")
+        (success, data, _) = await self.stream.read_records()
+        if not success:
+            raise Exception("Calibration failed")
+        (times, values, _, _) = decode(data)
+        return (times - times[0] if len(times) else times, values)
+
+    def request_run(self, keys=0, period=0, reset=False):
+        if keys:
+            self.send(client.OP_BURST, struct.pack("!HH", keys, period))
+        elif reset:
+            self.send(client.OP_MEASURE, bytes((client.MEASURE_RESET,)))
+        else:
+            self.send(client.OP_MEASURE)
+
+    async def read_run(self, keys=0):
+        op = client.OP_BURST if keys else client.OP_MEASURE
+        await self.accepted(op, "Burst rejected" if keys else "Measurement rejected")
+        (variance,) = struct.unpack("!H", await self.stream.read(2))
+        (success, data, arrivals) = await self.stream.read_records()
+        if not success:
+            raise Exception("Burst failed" if keys else "Measurement failed")
+
+        (data, reset_variance, reset_data) = split_segments(data)
+        run = self.read_segment(variance, data, arrivals, keys)
+        if reset_data is not None:
+            run.reset = self.read_segment(reset_variance, reset_data, arrivals[len(data) // 4 + 1:])
+        return run
+
+    def read_segment(self, variance, data, arrivals, keys=0):
+        (times, values, samples, telemetry) = decode(data)
+        status = client.health(telemetry, times)
+        events = None
+        if self.probe is not None and len(times):
+            events = client.align(self.probe, times, arrivals[samples])
+
+        if keys:
+            reports = (values & client.BURST_MARK) != 0
+            values = values & (0xFFFF ^ client.BURST_MARK)
+            inputs = None if events is None else {"trigger": 0, "events": events}
+            return Run(variance, times, values, reports, status, inputs)
+
+        # Relative to the first sample, which itself is left out, like the
+        # captures always had it. If the device held the samples back that's
+        # the first one it took, not the first one sent
+        if not len(times):
+            return Run(variance, times, values, None, status)
+        start = int(times[0]) - telemetry.get("skipped", 0) * client.SAMPLE_CYCLES
+        inputs = None if events is None else {"trigger": -start, "events": [t - start for t in events]}
+        kept = times > start
+        return Run(variance, times[kept] - start, values[kept], None, status, inputs)
+
+    async def measure(self, reset=False):
+        self.request_run(reset=reset)
+        return await self.read_run()
+
+    async def burst(self, keys, period):
+        self.request_run(keys, period)
+        return await self.read_run(keys)
+
+    async def monitor(self, stop):
+        # Watches the light without pressing anything, see OP_MONITOR. Yields
+        # (times, values) of the blocks as they come in, like unpack_blocks.
+        # Once stop, an asyncio.Event, is set the device is told to stop and
+        # whatever it sent until then is yielded too
+        self.send(client.OP_MONITOR)
+        await self.accepted(client.OP_MONITOR, "Monitoring rejected")
+        stopping = False
+        while True:
+            if stop.is_set() and not stopping:
+                # Any command stops it, asking for the info is harmless
+                self.send(client.OP_INFO)
+                stopping = True
+            (data, done) = await self.stream.read_blocks()
+            if data:
+                yield unpack_blocks(data)
+            if done:
+                break
+        if not stopping:
+            raise Exception("The device stopped monitoring on its own")
+        await self.accepted(client.OP_INFO, "Incorrect info response")
+
+    async def runs(self, count, delay=0, keys=0, period=0, reset=False):
+        # Yields count runs. Without a delay, keep the next one queued on the
+        # device so it starts as soon as the previous one is done
+        depth = 2 if delay == 0 else 1
+        queued = 0
+        for sample in range(count):
+            await asyncio.sleep(delay)
+            while queued < min(depth, count - sample):
+                self.request_run(keys, period, reset)
+                queued += 1
+            yield await self.read_run(keys)
+            queued -= 1
@@ -0,0 +1,117 @@
+import re
+
+# Input steps for the device, see OP_SEQUENCE in firmware/protocol.h. A step is
+# written as
+#   ctrl+shift+z       keys and modifiers held together
+#   release            let go of all keys
+#   mouse:left+right   mouse buttons held together, mouse:none lets go
+#   move:10,-5         move the mouse
+#   wheel:-1           scroll
+# optionally followed by @<n>ms to wait after the step
+
+STEP_MOUSE = 0x01
+STEP_RESET = 0x02
+
+MODIFIERS = {
+    "ctrl": 0x01,
+    "shift": 0x02,
+    "alt": 0x04,
+    "gui": 0x08,
+    "rctrl": 0x10,
+    "rshift": 0x20,
+    "ralt": 0x40,
+    "rgui": 0x80,
+}
+
+KEYS = {
+    **{chr(ord("a") + i): 0x04 + i for i in range(26)},
+    **{str((i + 1) % 10): 0x1E + i for i in range(10)},
+    "enter": 0x28,
+    "esc": 0x29,
+    "backspace": 0x2A,
+    "tab": 0x2B,
+    "space": 0x2C,
+    "minus": 0x2D,
+    "equal": 0x2E,
+    **{f"f{i + 1}": 0x3A + i for i in range(12)},
+    "insert": 0x49,
+    "home": 0x4A,
+    "pageup": 0x4B,
+    "delete": 0x4C,
+    "end": 0x4D,
+    "pagedown": 0x4E,
+    "right": 0x4F,
+    "left": 0x50,
+    "down": 0x51,
+    "up": 0x52,
+}
+
+BUTTONS = {
+    "left": 0x01,
+    "right": 0x02,
+    "middle": 0x04,
+}
+
+KEYBOARD_KEYS = 6
+
+def signed(value):
+    value = int(value)
+    if not -127 <= value <= 127:
+        raise ValueError(f"{value} is out of range for a mouse report")
+    return value & 0xFF
+
+def parse_keyboard(spec):
+    modifier = 0
+    keys = []
+    if spec != "release":
+        for name in spec.split("+"):
+            name = name.strip().lower()
+            if name in MODIFIERS:
+                modifier |= MODIFIERS[name]
+            elif name in KEYS:
+                keys.append(KEYS[name])
+            elif re.fullmatch(r"0x[0-9a-f]{1,2}", name):
+                keys.append(int(name, 16))
+            else:
+                raise ValueError(f"Unknown key {name}")
+    if len(keys) > KEYBOARD_KEYS:
+        raise ValueError(f"At most {KEYBOARD_KEYS} keys can be held at once")
+    return (0, bytes([modifier, 0] + keys + [0] * (KEYBOARD_KEYS - len(keys))))
+
+def parse_mouse(kind, args):
+    if kind == "mouse":
+        buttons = 0
+        if args != "none":
+            for name in args.split("+"):
+                if name not in BUTTONS:
+                    raise ValueError(f"Unknown mouse button {name}")
+                buttons |= BUTTONS[name]
+        return (STEP_MOUSE, bytes((buttons, 0, 0, 0)))
+    if kind == "move":
+        (x, y) = args.split(",")
+        return (STEP_MOUSE, bytes((0, signed(x), signed(y), 0)))
+    if kind == "wheel":
+        return (STEP_MOUSE, bytes((0, 0, 0, signed(args))))
+    raise ValueError(f"Unknown step {kind}")
+
+def parse_step(spec, reset=False):
+    # Returns (flags, delay, report)
+    delay = 0
+    match = re.fullmatch(r"(.*)@(\d+)ms", spec)
+    if match is not None:
+        (spec, delay) = (match.group(1), int(match.group(2)))
+    if delay > 0xFFFF:
+        raise ValueError(f"Delay {delay}ms is too long")
+
+    if ":" in spec:
+        (flags, report) = parse_mouse(*spec.split(":", 1))
+    else:
+        (flags, report) = parse_keyboard(spec)
+
+    if reset:
+        flags |= STEP_RESET
+    return (flags, delay, report)
+
+def encode(index, step):
+    (flags, delay, report) = step
+    return bytes((index, flags, delay >> 8, delay & 0xFF)) + report
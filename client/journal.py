@@ -0,0 +1,104 @@
+import os
+import re
+import sys
+import zlib
+
+# Every run in a capture is written as one block, followed by a checksum of the
+# block and an empty line. The file is only ever appended to, so a crash or
+# a disconnect can at worst leave a damaged run at the very end, which scan()
+# finds and --resume cuts off. Damage anywhere else stops --resume.
+
+CHECKSUM = "checksum = "
+
+def checksum(block):
+    return f"{zlib.crc32(block.encode()):08x}"
+
+def seal(block):
+    return f"{block}{CHECKSUM}{checksum(block)}\n\n"
+
+def verify(lines):
+    # True if the block is intact. Blocks written before the checksums were
+    # added have no checksum line, they are trusted as long as they were
+    # terminated
+    if not lines[-1].startswith(CHECKSUM):
+        return True
+    return lines[-1][len(CHECKSUM):].strip() == checksum("".join(lines[:-1]))
+
+def scan(path):
+    # Returns the byte offset just past the last intact run, and the number the
+    # next run should get. Only the last run can have been torn by a crash,
+    # a damaged run with more after it is something else and raises
+    # a ValueError, cutting it off would take the runs after it with it
+    end = 0
+    next_sample = 0
+    offset = 0
+    damaged = None
+    block = []
+    with open(path, "rb") as f:
+        for line in f:
+            offset += len(line)
+            if line != b"\n":
+                block.append(line.decode(errors="replace"))
+                continue
+            if not block:
+                continue
+
+            if damaged is not None:
+                raise ValueError(f"{path}: {damaged} is damaged and not the last run, refusing to resume")
+            match = re.match(r"Measurement (\d+)", block[0])
+            if match is None or not verify(block):
+                damaged = block[0].strip()
+            else:
+                end = offset
+                next_sample = int(match.group(1)) + 1
+            block = []
+
+    return (end, next_sample)
+
+class Journal(object):
+    def __init__(self, f, next_sample=0, sync_every=100, durable=True):
+        self.file = f
+        self.next_sample = next_sample
+        self.sync_every = sync_every
+        self.durable = durable
+        self.pending = 0
+
+    def append(self, block):
+        # Hand every run to the OS right away, so only a power loss can lose
+        # it. Syncing to disk is batched since it costs milliseconds
+        self.file.write(seal(block).encode())
+        self.file.flush()
+        self.next_sample += 1
+        self.pending += 1
+        if self.pending >= self.sync_every:
+            self.sync()
+
+    def sync(self):
+        if self.durable and self.pending:
+            os.fsync(self.file.fileno())
+        self.pending = 0
+
+    def close(self):
+        self.sync()
+        if self.file is not sys.stdout.buffer:
+            self.file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+def open_journal(path, resume=False, sync_every=100):
+    if path == "-":
+        return Journal(sys.stdout.buffer, durable=False)
+
+    if resume and os.path.exists(path):
+        (end, next_sample) = scan(path)
+        f = open(path, "r+b")
+        # Drop whatever is left of the run we were writing when we went down
+        f.truncate(end)
+        f.seek(end)
+        return Journal(f, next_sample, sync_every)
+
+    return Journal(open(path, "wb"), 0, sync_every)
@@ -0,0 +1,105 @@
+import queue
+import collections
+import numpy as np
+import matplotlib.pyplot as plt
+from matplotlib.animation import FuncAnimation
+
+import analyze
+import filters
+
+class LiveView(object):
+    # Plots the capture while it runs. The capture thread only ever calls
+    # feed(), which just queues the run. Everything else happens in the GUI
+    # thread, so a slow redraw never holds up the serial reader
+    def __init__(self, time_units, overlay=20, max_points=512, interval=100):
+        self.time_units = time_units
+        self.max_points = max_points
+        self.interval = interval
+        self.queue = queue.SimpleQueue()
+        self.runs = collections.deque(maxlen=overlay)
+        self.changetimes = []
+        self.rejected = 0
+        self.count = 0
+
+    def feed(self, measurement):
+        self.queue.put(measurement)
+
+    def decimate(self, times, values):
+        stride = max(1, len(times) // self.max_points)
+        return (times[::stride], values[::stride])
+
+    def changetime(self, times, values):
+        if len(times) < 8:
+            return None
+        (times, values) = analyze.linear_interp(times, values)
+        values = filters.moving_average(values)
+        times = times[2:-2]
+        (changetimes, _, _, reject) = analyze.analyze_runs(times[None, :], values[None, :])
+        if reject[0]:
+            return None
+        return changetimes[0]
+
+    def drain(self):
+        latest = None
+        while True:
+            try:
+                measurement = self.queue.get_nowait()
+            except queue.Empty:
+                return latest
+
+            self.count += 1
+            times = np.array([t for (t, _) in measurement], dtype=float)
+            values = np.array([v for (_, v) in measurement], dtype=float)
+
+            changetime = self.changetime(times, values)
+            if changetime is None:
+                self.rejected += 1
+            else:
+                self.changetimes.append(changetime)
+
+            latest = self.decimate(times, values)
+            self.runs.append(latest)
+
+    def update(self, frame):
+        latest = self.drain()
+        if latest is None:
+            return
+
+        self.trace.set_data(*latest)
+        self.trace_ax.relim()
+        self.trace_ax.autoscale_view()
+
+        for line in self.overlay:
+            line.remove()
+        self.overlay = [self.overlay_ax.plot(t, v, color="C0", alpha=.2)[0] for (t, v) in self.runs]
+        self.overlay_ax.relim()
+        self.overlay_ax.autoscale_view()
+
+        self.hist_ax.cla()
+        self.hist_ax.set_xlabel(f"Change time ({self.time_units})")
+        if self.changetimes:
+            self.hist_ax.hist(self.changetimes, bins=50)
+
+        self.figure.suptitle(f"{self.count} runs, {self.rejected} rejected")
+
+    def run(self, capture):
+        # Blocks until the window is closed. capture is the thread doing the
+        # measurement, we stop polling once it is done
+        self.figure, (self.trace_ax, self.overlay_ax, self.hist_ax) = plt.subplots(3, 1)
+        self.trace_ax.set_title("Latest run")
+        self.overlay_ax.set_title(f"Last {self.runs.maxlen} runs")
+        for ax in (self.trace_ax, self.overlay_ax):
+            ax.set_xlabel(f"Time since keypress ({self.time_units})")
+        (self.trace,) = self.trace_ax.plot([], [])
+        self.overlay = []
+
+        def frames():
+            while capture.is_alive():
+                yield None
+            # Pick up whatever arrived after the last redraw
+            yield None
+
+        self.animation = FuncAnimation(self.figure, self.update, frames=frames,
+                interval=self.interval, repeat=False, cache_frame_data=False)
+        plt.tight_layout()
+        plt.show()
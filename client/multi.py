@@ -0,0 +1,103 @@
+#!/bin/python3
+
+import asyncio
+import click
+import json
+import os
+import sys
+import time
+from datetime import datetime, timezone
+from pathlib import Path
+
+import client
+import frametime
+from journal import open_journal
+
+# Captures from several devices at once, say one on every monitor. Every device
+# gets a task of its own and a capture named after its serial number. Every
+# run is stamped with the monotonic clock of the host when it came in, which all
+# devices share, so runs on different devices can be lined up afterwards.
+# index.json ties that clock to the wall clock.
+
+async def capture(port, path, samples, delay, convert, steps, keys, period, time_reset, trigger, sync_every, result):
+    async with frametime.Device(port) as device:
+        resolution = await device.configure(steps, convert, trigger)
+        result["resolution"] = resolution
+        time_units = "us" if convert else "cycles"
+
+        with open_journal(str(path), sync_every=sync_every) as journal:
+            sample = 0
+            async for run in device.runs(samples, delay, keys, period, time_reset):
+                host = time.monotonic_ns()
+                journal.append(client.format_run(sample, run.variance, run.rows(resolution), time_units, keys != 0, run.health, host=host, reset=run.segment(resolution)))
+                sample += 1
+                result["samples"] = sample
+
+async def capture_all(ports, output, index, *args):
+    # Returns the failures by device
+    failures = {}
+    async def run(name, port):
+        result = {"port": port, "file": f"{name}.measure", "samples": 0}
+        index["devices"][name] = result
+        try:
+            await capture(port, output / result["file"], *args, result)
+        except Exception as e:
+            failures[name] = e
+    await asyncio.gather(*(run(name, port) for (name, port) in ports))
+    return failures
+
+@click.command()
+@click.option("--output", "-o", type=click.Path(file_okay=False), default=None, help="Directory to write the captures to")
+@click.option("--delay", "-d", type=click.FLOAT, default=0, help="Wait n seconds before taking each measurement")
+@click.option("--samples", "-s", type=click.INT, default=1, help="Number of samples to take on every device")
+@click.option("--convert", "-c", is_flag=True, help="Convert the time values to microseconds")
+@click.option("--sync-every", type=click.INT, default=100, help="Sync the output to disk every n samples")
+@click.option("--device", "devices", multiple=True, help="Serial number or serial port of a device to capture from, all of them by default")
+@click.option("--list", "list_devices", is_flag=True, help="List the devices and exit")
+@client.input_options
+def main(output, delay, samples, convert, sync_every, devices, list_devices, inputs, reset_inputs, keys, rate, time_reset, trigger, pretrigger, trigger_wait):
+    if list_devices:
+        for (number, port) in client.find_devices():
+            print(f"{number} {port}")
+        return
+    if output is None:
+        raise click.UsageError("Missing option --output")
+
+    try:
+        (steps, period, trigger) = client.check_inputs(inputs, reset_inputs, keys, rate, time_reset, trigger, pretrigger, trigger_wait)
+    except ValueError as e:
+        raise click.UsageError(str(e))
+
+    # Name every capture after the serial number of the device, or the port
+    # for ones we can't look up, like the emulator
+    if devices:
+        ports = [(device if not os.path.exists(device) else Path(device).name, client.open_device(device)) for device in devices]
+    else:
+        ports = client.find_devices()
+    if not ports:
+        raise click.UsageError("No device found")
+    if len(set(name for (name, _) in ports)) != len(ports):
+        raise click.UsageError("Devices have to have different serial numbers")
+
+    output = Path(output)
+    output.mkdir(parents=True, exist_ok=True)
+
+    index = {
+        "clock": {"monotonic_ns": time.monotonic_ns(), "wall": datetime.now(timezone.utc).isoformat()},
+        "time_units": "us" if convert else "cycles",
+        "devices": {},
+    }
+    try:
+        failures = asyncio.run(capture_all(ports, output, index, samples, delay, convert, steps, keys, period, time_reset, trigger, sync_every))
+    finally:
+        index["finished"] = datetime.now(timezone.utc).isoformat()
+        with open(output / "index.json", "w") as f:
+            json.dump(index, f, indent=2)
+
+    for (name, e) in failures.items():
+        sys.stderr.write(f"{name}: {e}\n")
+    if failures:
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
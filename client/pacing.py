@@ -0,0 +1,259 @@
+#!/bin/python3
+
+import asyncio
+import click
+import numpy as np
+import signal
+import sys
+
+import analyze
+import client
+import frametime
+
+# Frame pacing from passive monitoring. Point the sensor at something that
+# changes every frame, like a flashing square in a looping animation, and every
+# frame shows up as a step in the light level. The time between two steps is
+# a frame time. Captures can run for hours, so the light is looked at as it
+# comes in and only a histogram of the frame times is kept.
+
+# Samples looked at in one go, about a second
+CHUNK = 1 << 14
+# A step that is still going after this many samples is cut short
+MAX_STEP = CHUNK
+# Monitor blocks read from a saved capture at a time
+READ_BLOCKS = 1024
+# Seconds between progress reports of a live capture
+PROGRESS = 10
+
+class Pacing(object):
+    # Counts the frame times, in samples. A step is where the mean of window
+    # samples differs from the mean of the window samples before it by at
+    # least threshold, placed at the center of that difference. Steps less
+    # than min_gap samples after the last one are part of it. Frame times up
+    # to longest samples get a bin of their own
+    def __init__(self, window, threshold, min_gap, longest):
+        self.window = window
+        self.threshold = threshold
+        self.min_gap = min_gap
+        self.histogram = np.zeros(longest + 1, dtype=np.int64)
+        # Frames that didn't fit in the histogram, and the longest frame
+        self.longer = 0
+        self.longest = 0
+        self.total = 0
+        self.samples = 0
+        self.lost = 0
+        # Samples not looked at yet, and the number of the first one
+        self.pending = np.empty(0, dtype=np.int64)
+        self.start = 0
+        # The last step, None until there is one and after samples went
+        # missing
+        self.last = None
+        # Time and number of the last monitor block
+        self.time = None
+        self.number = 0
+
+    def feed_blocks(self, times, values):
+        # Monitor blocks like frametime.unpack_blocks returns them. Their times
+        # are 32 bits of device cycles, which tell where samples are missing
+        if self.time is None:
+            (self.time, self.number) = (times[0], 0)
+        deltas = np.diff(times, prepend=self.time) % (1 << 32)
+        numbers = self.number + np.cumsum(np.rint(deltas / client.MONITOR_SAMPLE_CYCLES).astype(np.int64))
+        (self.time, self.number) = (times[-1], numbers[-1])
+
+        breaks = np.flatnonzero(np.diff(numbers) != client.MONITOR_BLOCK) + 1
+        for (first, run) in zip(np.split(numbers, breaks), np.split(values, breaks)):
+            self.feed(first[0], run.ravel())
+
+    def feed(self, first, values):
+        # first is the number of the first sample in values, counted from the
+        # start of the monitoring
+        expected = self.start + len(self.pending)
+        if self.samples and first != expected:
+            # No frame time can span the gap
+            self.lost += first - expected
+            self.steps(final=True)
+            self.pending = self.pending[:0]
+            self.last = None
+        if not len(self.pending):
+            self.start = first
+        self.pending = np.concatenate([self.pending, values])
+        self.samples += len(values)
+        if len(self.pending) >= CHUNK:
+            self.steps()
+
+    def finish(self):
+        self.steps(final=True)
+
+    def steps(self, final=False):
+        w = self.window
+        n = len(self.pending)
+        if n < 2 * w:
+            return
+        sums = np.concatenate(([0], np.cumsum(self.pending)))
+        at = np.arange(w, n - w + 1)
+        # The difference of the means, times the window
+        change = np.abs(sums[at + w] - 2 * sums[at] + sums[at - w])
+        over = np.diff(np.concatenate(([0], change >= self.threshold * w, [0])).astype(np.int8))
+        (begins, ends) = (np.flatnonzero(over == 1), np.flatnonzero(over == -1))
+
+        done = len(at)
+        if len(ends) and ends[-1] == len(at) and not final and len(at) - begins[-1] < MAX_STEP:
+            # The last step might not be over yet, look at it again next time
+            done = begins[-1]
+            (begins, ends) = (begins[:-1], ends[:-1])
+        for (begin, end) in zip(begins, ends):
+            weights = change[begin:end]
+            self.step(self.start + np.dot(at[begin:end], weights) / weights.sum())
+
+        # Keep the window before the first sample not looked at
+        keep = (at[done] if done < len(at) else n - w + 1) - w
+        self.pending = self.pending[keep:]
+        self.start += keep
+
+    def step(self, at):
+        if self.last is not None:
+            frame = int(round(at - self.last))
+            if frame < self.min_gap:
+                return
+            if frame < len(self.histogram):
+                self.histogram[frame] += 1
+            else:
+                self.longer += 1
+            self.longest = max(self.longest, frame)
+            self.total += frame
+        self.last = at
+
+    def frames(self):
+        return int(self.histogram.sum()) + self.longer
+
+    def percentile(self, q):
+        # The frame time q percent of the frames are shorter than or as long
+        # as, the longest frame if that's past the histogram
+        index = np.searchsorted(np.cumsum(self.histogram), q / 100 * self.frames())
+        return index if index < len(self.histogram) else self.longest
+
+    def summary(self, hitch):
+        # Frame times in samples, None without any frames. Hitches are frames
+        # longer than hitch times the median
+        frames = self.frames()
+        if not frames:
+            return None
+        median = self.percentile(50)
+        over = int(hitch * median) + 1
+        return {
+            "frames": frames,
+            "mean": self.total / frames,
+            "median": median,
+            "p99": self.percentile(99),
+            "p99.9": self.percentile(99.9),
+            "max": self.longest,
+            "hitches": int(self.histogram[over:].sum()) + self.longer,
+        }
+
+def report(title, pacing, clock, hitch, output, histogram):
+    # Frame times in milliseconds. The lows are the frame rate the slowest 1%
+    # and 0.1% of the frames ran at
+    ms = client.MONITOR_SAMPLE_CYCLES / clock * 1000
+    if pacing.lost:
+        sys.stderr.write(f"{title}: lost {pacing.lost} samples, the host didn't keep up\n")
+    summary = pacing.summary(hitch)
+    if summary is None:
+        raise Exception(f"{title}: no frames, is the sensor on something that changes every frame?")
+
+    seconds = pacing.samples * ms / 1000
+    (mean, median, p99, p999, longest) = (summary[name] * ms for name in ("mean", "median", "p99", "p99.9", "max"))
+    output.write(f"{title:>20} {seconds:10.1f} {summary['frames']:10d} {1000 / mean:10.2f} {mean:10.3f} {median:10.3f} {p99:10.3f} {p999:10.3f} {longest:10.3f} {1000 / p99:10.2f} {1000 / p999:10.2f} {summary['hitches']:10d}\n")
+
+    if histogram is not None:
+        lengths = np.flatnonzero(pacing.histogram)
+        histogram.writelines(f"{title};{n * ms};{pacing.histogram[n]}\n" for n in lengths)
+
+def replay(path, pacing):
+    # A capture saved with --save, some blocks at a time. It doesn't know the
+    # clock it was taken with, so times assume F_CPU
+    with open(path, "rb") as f:
+        while True:
+            data = f.read(READ_BLOCKS * client.MONITOR_BLOCK_BYTES)
+            whole = len(data) // client.MONITOR_BLOCK_BYTES * client.MONITOR_BLOCK_BYTES
+            if not whole:
+                break
+            pacing.feed_blocks(*frametime.unpack_blocks(data[:whole]))
+    pacing.finish()
+
+async def capture(device, simulate, duration, save, pacing):
+    # Returns the clock of the device
+    stream = None
+    if simulate:
+        import simulator
+        stream = frametime.SimulatedStream(simulator.SimulatedDevice())
+    async with frametime.Device(device, stream=stream) as dev:
+        clock = await dev.clock() or await dev.info()
+        stop = asyncio.Event()
+        loop = asyncio.get_running_loop()
+        loop.add_signal_handler(signal.SIGINT, stop.set)
+        if duration:
+            loop.call_later(duration, stop.set)
+
+        progress = PROGRESS
+        async for (times, values) in dev.monitor(stop):
+            if save is not None:
+                save.write(frametime.pack_blocks(times, values))
+            pacing.feed_blocks(times, values)
+            seconds = pacing.samples * client.MONITOR_SAMPLE_CYCLES / clock
+            if seconds >= progress:
+                sys.stderr.write(f"{seconds:.0f}s: {pacing.frames()} frames\n")
+                progress += PROGRESS
+        loop.remove_signal_handler(signal.SIGINT)
+    pacing.finish()
+    return clock
+
+@click.command()
+@click.argument("data", nargs=-1)
+@click.option("--output", "-o", type=click.File("w"), default=sys.stdout, help="Write values to files instead of stdout")
+@click.option("--header", is_flag=True, help="Write a header")
+@click.option("--histogram", type=click.File("w"), default=None, help="Write the frame time histogram to this file")
+@click.option("--device", default=None, help="Serial port or serial number of the device to capture from, without any captures given")
+@click.option("--simulate", is_flag=True, help="Capture from a simulated device")
+@click.option("--duration", type=click.FloatRange(min=0), default=0, help="Seconds to capture for, until interrupted by default")
+@click.option("--save", type=click.File("wb"), default=None, help="Save the capture to this file, to analyze again later")
+@click.option("--title", default="live", help="Title of the live capture")
+@click.option("--threshold", type=click.FloatRange(min=0, min_open=True), default=10, help="Change in light level (ADC counts) that makes a new frame")
+@click.option("--window", type=click.FloatRange(min=0, min_open=True), default=.5, help="Milliseconds of light averaged on either side of a change")
+@click.option("--min-frame", type=click.FloatRange(min=0), default=1, help="Shortest frame time in milliseconds, closer changes are one frame")
+@click.option("--longest", type=click.FloatRange(min=1), default=250, help="Frame times up to this many milliseconds are binned exactly")
+@click.option("--hitch", type=click.FloatRange(min=1), default=1.5, help="Frames longer than this many times the median are hitches")
+def main(data, output, header, histogram, device, simulate, duration, save, title, threshold, window, min_frame, longest, hitch):
+    if data and (device is not None or simulate or save is not None):
+        raise click.UsageError("Either capture or analyze saved captures")
+
+    def pacing_for(clock):
+        samples = clock / 1000 / client.MONITOR_SAMPLE_CYCLES
+        return Pacing(max(1, round(window * samples)), threshold, round(min_frame * samples), round(longest * samples))
+
+    if header:
+        output.write(f"               title    seconds     frames        fps    ft_mean     ft_p50     ft_p99   ft_p99.9     ft_max     low_1%   low_0.1%    hitches\n")
+    if histogram is not None:
+        histogram.write("title;frame_time(ms);count\n")
+
+    if not data:
+        pacing = pacing_for(client.F_CPU)
+        clock = asyncio.run(capture(device, simulate, duration, save, pacing))
+        report(title, pacing, clock, hitch, output, histogram)
+        return
+
+    args = [analyze.InputArg(x) for x in data]
+    for arg in args:
+        if arg.path.exists() and arg.path.is_file():
+            continue
+
+        sys.stderr.write(f"{arg.path}: file does not exist\n")
+        exit(1)
+
+    for arg in args:
+        pacing = pacing_for(client.F_CPU)
+        replay(arg.path, pacing)
+        report(arg.title, pacing, client.F_CPU, hitch, output, histogram)
+
+if __name__ == "__main__":
+    main()
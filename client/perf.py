@@ -0,0 +1,140 @@
+#!/bin/python3
+
+import asyncio
+import click
+import json
+import os
+import platform
+import sys
+import tempfile
+import time
+from datetime import datetime, timezone
+
+import analyze
+import client
+import filters
+import frametime
+import simulator
+from journal import open_journal
+
+# Throughput of the host side: capturing, writing, reading and analyzing runs.
+# Every benchmark reports runs per second, higher is better. Save the results as
+# a baseline on the machine that does the measuring, and compare against it
+# after changing the tools.
+
+def best_of(repeat, function):
+    # Seconds the fastest of repeat calls took. The fastest is the one least
+    # disturbed by whatever else the machine was doing
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        function()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+def generate(runs, seed):
+    # Runs as the device would send them, already formatted for the output
+    async def capture():
+        blocks = []
+        async with frametime.Device(stream=frametime.SimulatedStream(simulator.SimulatedDevice(seed=seed))) as dev:
+            await dev.configure()
+            async for run in dev.runs(runs):
+                blocks.append(client.format_run(len(blocks), run.variance, run.rows(), "cycles", status=run.health))
+        return blocks
+    return asyncio.run(capture())
+
+def bench_capture(runs, repeat, seed, device):
+    # Requests, receives and decodes runs. Against the in-process simulator by
+    # default, or whatever is at device, like the emulator
+    async def capture():
+        stream = frametime.SimulatedStream(simulator.SimulatedDevice(seed=seed)) if device is None else None
+        async with frametime.Device(device, stream=stream) as dev:
+            await dev.configure()
+            async for _ in dev.runs(runs):
+                pass
+    return runs / best_of(repeat, lambda: asyncio.run(capture()))
+
+def bench_write(blocks, repeat, directory):
+    # The output loop of client.py, checksums and syncs included
+    path = os.path.join(directory, "write.measure")
+    def write():
+        with open_journal(path) as journal:
+            for block in blocks:
+                journal.append(block)
+    return len(blocks) / best_of(repeat, write)
+
+def bench_parse(path, runs, repeat):
+    def parse():
+        with open(path, "r") as f:
+            analyze.read_measurements(f)
+    return runs / best_of(repeat, parse)
+
+def bench_analyze(path, runs, repeat, filter_name):
+    return runs / best_of(repeat, lambda: analyze.analyze_file(path, filter_name, None))
+
+def run_all(runs, repeat, seed, device):
+    results = {}
+    blocks = generate(runs, seed)
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "capture.measure")
+        with open_journal(path) as journal:
+            for block in blocks:
+                journal.append(block)
+
+        results["capture"] = bench_capture(runs, repeat, seed, device)
+        results["write"] = bench_write(blocks, repeat, directory)
+        results["parse"] = bench_parse(path, runs, repeat)
+        for name in filters.FILTERS:
+            results[f"analyze_{name}"] = bench_analyze(path, runs, repeat, name)
+    return results
+
+@click.command()
+@click.option("--runs", "-n", type=click.INT, default=500, help="Runs to push through every benchmark")
+@click.option("--repeat", "-r", type=click.INT, default=3, help="Take the best of n repetitions")
+@click.option("--seed", type=click.INT, default=0, help="Seed for the simulated runs")
+@click.option("--device", type=click.Path(), default=None, help="Capture from this serial port instead of the built in simulator")
+@click.option("--save", type=click.Path(dir_okay=False), default=None, help="Save the results as a baseline")
+@click.option("--compare", type=click.Path(exists=True, dir_okay=False), default=None, help="Compare against a saved baseline")
+@click.option("--tolerance", type=click.FLOAT, default=.2, help="How much slower than the baseline counts as a regression")
+def main(runs, repeat, seed, device, save, compare, tolerance):
+    results = run_all(runs, repeat, seed, device)
+
+    baseline = None
+    if compare is not None:
+        with open(compare, "r") as f:
+            baseline = json.load(f)
+        if baseline["runs"] != runs:
+            sys.stderr.write(f"Baseline was taken with {baseline['runs']} runs, not {runs}\n")
+
+    regressed = []
+    print(f"{'benchmark':>20} {'runs/s':>12} {'baseline':>12} {'change':>8}")
+    for (name, rate) in results.items():
+        line = f"{name:>20} {rate:12.1f}"
+        if baseline is not None and name in baseline["results"]:
+            old = baseline["results"][name]
+            change = rate / old - 1
+            line += f" {old:12.1f} {change:+8.1%}"
+            if change < -tolerance:
+                regressed.append(name)
+                line += " regressed"
+        print(line)
+
+    if save is not None:
+        with open(save, "w") as f:
+            json.dump({
+                "date": datetime.now(timezone.utc).isoformat(),
+                "machine": platform.node(),
+                "python": platform.python_version(),
+                "runs": runs,
+                "repeat": repeat,
+                "device": device,
+                "results": results,
+            }, f, indent=2)
+
+    if regressed:
+        sys.stderr.write(f"Slower than the baseline: {', '.join(regressed)}\n")
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
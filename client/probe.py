@@ -0,0 +1,89 @@
+import fcntl
+import glob
+import os
+import select
+import struct
+import threading
+from pathlib import Path
+
+# Timestamps the input events the kernel sees from the device. The kernel
+# stamps every event as it comes out of the HID driver, so comparing that with
+# when the device sent the report, and when the light changed, splits the lag
+# into the part spent getting the key into the kernel and the rest.
+#
+# Needs read access to /dev/input/event*, usually root or the input group.
+
+VENDOR = 0x16C0
+PRODUCT = 0x047A
+
+# struct input_event, a struct timeval followed by type, code and value
+EVENT = struct.Struct("@llHHi")
+EV_KEY = 0x01
+EV_REL = 0x02
+# Autorepeat, the device never sends it but the kernel makes it up
+KEY_REPEAT = 2
+
+# _IOW('E', 0xa0, int), which clock the kernel stamps the events with
+EVIOCSCLOCKID = 0x400445A0
+CLOCK_MONOTONIC = 1
+
+def find_inputs():
+    # Every event device of the keyboard and mouse interfaces
+    paths = []
+    for event in sorted(glob.glob("/sys/class/input/event*")):
+        ids = Path(event) / "device" / "id"
+        try:
+            vendor = int((ids / "vendor").read_text(), 16)
+            product = int((ids / "product").read_text(), 16)
+        except (OSError, ValueError):
+            continue
+        if vendor == VENDOR and product == PRODUCT:
+            paths.append(f"/dev/input/{Path(event).name}")
+    return paths
+
+class Probe(object):
+    def __init__(self, paths=None):
+        paths = paths if paths is not None else find_inputs()
+        if not paths:
+            raise Exception("Found no input device of the FrameTime")
+        self.fds = []
+        for path in paths:
+            fd = os.open(path, os.O_RDONLY | os.O_NONBLOCK)
+            fcntl.ioctl(fd, EVIOCSCLOCKID, struct.pack("i", CLOCK_MONOTONIC))
+            self.fds.append(fd)
+
+        self.events = []
+        self.lock = threading.Lock()
+        (self.wake, self.stop) = os.pipe()
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def run(self):
+        while True:
+            (readable, _, _) = select.select(self.fds + [self.wake], [], [])
+            if self.wake in readable:
+                return
+            for fd in readable:
+                try:
+                    data = os.read(fd, EVENT.size * 64)
+                except BlockingIOError:
+                    continue
+                with self.lock:
+                    for (sec, usec, kind, code, value) in EVENT.iter_unpack(data):
+                        if kind == EV_REL or (kind == EV_KEY and value != KEY_REPEAT):
+                            self.events.append(sec * 1000000000 + usec * 1000)
+
+    def take(self, start, end):
+        # Monotonic times in ns of the events between start and end. Anything
+        # before end is dropped, later events could still belong to the next
+        # run
+        with self.lock:
+            taken = [t for t in self.events if start <= t <= end]
+            self.events = [t for t in self.events if t > end]
+        return taken
+
+    def close(self):
+        os.write(self.stop, b"\0")
+        self.thread.join()
+        for fd in self.fds + [self.wake, self.stop]:
+            os.close(fd)
@@ -0,0 +1,328 @@
+import random
+import struct
+import numpy as np
+
+import client
+import frametime
+
+# A stand in for the device that speaks the same protocol over a Serial-like
+# read/write interface. The light level is made up from a simple model of an
+# application: the key takes lag seconds (plus some jitter) to get through,
+# and then shows up with the next frame of the display.
+
+F_CPU = 16000000
+SAMPLE_CYCLES = 896
+MEASURE_SAMPLES = 1024
+CALIBRATE_SAMPLES = 100
+BURST_TAIL = .2
+# Cycles from the keypress until the first sample, about what the device takes
+# to get the variance out
+FIRST_SAMPLE = 2000
+
+DISTRIBUTIONS = ["uniform", "normal", "exponential"]
+SHAPES = ["linear", "exponential"]
+
+class Model(object):
+    # lag and jitter are in seconds, how the jitter is spread depends on the
+    # distribution. The new frame shows up at the next refresh (Hz, 0 for
+    # right away) and takes rise seconds to go from 10% to 90%. pwm is the
+    # frequency of the backlight (Hz, 0 for none) and pwm_depth how far it dims
+    # the light. noise is the standard deviation in ADC counts. When monitored
+    # the application animates, flipping the light every refresh except for
+    # the stutter fraction of frames that miss one
+    def __init__(self, lag=.02, jitter=.002, distribution="uniform", refresh=60, rise=.002, shape="linear",
+            low=100, high=400, pwm=0, pwm_depth=.1, noise=3, stutter=.01):
+        if distribution not in DISTRIBUTIONS:
+            raise ValueError(f"Unknown distribution {distribution}")
+        if shape not in SHAPES:
+            raise ValueError(f"Unknown shape {shape}")
+        self.lag = lag
+        self.jitter = jitter
+        self.distribution = distribution
+        self.refresh = refresh
+        self.rise = rise
+        self.shape = shape
+        self.low = low
+        self.high = high
+        self.pwm = pwm
+        self.pwm_depth = pwm_depth
+        self.noise = noise
+        self.stutter = stutter
+
+    def delay(self, rng):
+        # Seconds from the key to the application having drawn it
+        if self.distribution == "normal":
+            jitter = rng.gauss(0, self.jitter)
+        elif self.distribution == "exponential":
+            jitter = rng.expovariate(1 / self.jitter) if self.jitter else 0
+        else:
+            jitter = rng.uniform(0, self.jitter)
+        return max(0, self.lag + jitter)
+
+    def step(self, since):
+        # Fraction of the way to the new level, since cycles after the flip
+        rise = self.rise * F_CPU
+        if rise <= 0:
+            return (since >= 0).astype(float)
+        if self.shape == "exponential":
+            # 10% to 90% takes 2.2 time constants
+            return 1 - np.exp(-np.maximum(since, 0) / (rise / 2.2))
+        return np.clip(since / (rise / .8), 0, 1)
+
+    def midpoint(self):
+        # Cycles from the flip until the light is half way
+        rise = self.rise * F_CPU
+        if self.shape == "exponential":
+            return rise / 2.2 * np.log(2)
+        return rise / .8 / 2
+
+class SimulatedDevice(object):
+    def __init__(self, model=None, seed=None, hello=True, clock=F_CPU):
+        self.model = model or Model()
+        # What the crystal actually runs at, only OP_CLOCK sees it
+        self.clock = clock
+        self.random = random.Random(seed)
+        self.noise = np.random.default_rng(seed)
+        self.input = bytearray()
+        self.output = bytearray()
+        self.timeout = None
+        self.has_trigger = False
+        self.has_reset = False
+        # (threshold, pretrigger, wait in samples) set with OP_TRIGGER
+        self.trigger = None
+        # While monitoring, the next sample and the flips of the animation
+        # that can still show in it, starting from the high level if
+        # monitor_high
+        self.monitoring = False
+        self.monitor_sample = 0
+        self.monitor_flips = []
+        self.monitor_high = False
+        # Called with the change time of every measurement, relative to the
+        # first sample like analyze.py reports it
+        self.truth = None
+        if hello:
+            self.connect()
+
+    def connect(self):
+        # What the device does when the host raises DTR
+        self.input.clear()
+        self.trigger = None
+        self.monitoring = False
+        self.respond(0, client.OP_HELLO, client.STATUS_ACCEPT, b"ScreenTimer")
+
+    def respond(self, seq, op, status, payload=b""):
+        self.output += bytes((client.FRAME_RESPONSE, seq, op, status, len(payload))) + payload
+
+    def write(self, data):
+        # Anything from the host ends the monitoring, and is then read as
+        # a command
+        if self.monitoring:
+            self.monitoring = False
+            self.output += client.SUCCESS
+        self.input += data
+        while True:
+            start = self.input.find(client.FRAME_COMMAND)
+            if start < 0:
+                self.input.clear()
+                return len(data)
+            del self.input[:start]
+            if len(self.input) < 4 or len(self.input) < 4 + self.input[3]:
+                return len(data)
+            (_, seq, op, length) = self.input[:4]
+            payload = bytes(self.input[4:4 + length])
+            del self.input[:4 + length]
+            self.command(seq, op, payload)
+
+    def read(self, size=1):
+        data = bytes(self.output[:size])
+        del self.output[:size]
+        return data
+
+    def close(self):
+        pass
+
+    def command(self, seq, op, payload):
+        if op == client.OP_INFO:
+            self.respond(seq, op, client.STATUS_ACCEPT, struct.pack("!I", F_CPU))
+        elif op == client.OP_KEYCODES and len(payload) == 2:
+            self.has_trigger = True
+            self.has_reset = True
+            self.respond(seq, op, client.STATUS_ACCEPT)
+        elif op == client.OP_SEQUENCE and len(payload) >= 2:
+            if payload[0] == 0:
+                self.has_trigger = False
+                self.has_reset = False
+            self.has_trigger |= not payload[1] & 0x02
+            self.has_reset |= bool(payload[1] & 0x02)
+            self.respond(seq, op, client.STATUS_ACCEPT)
+        elif op == client.OP_CLOCK and len(payload) == 2:
+            (frames,) = struct.unpack("!H", payload)
+            self.respond(seq, op, client.STATUS_ACCEPT, struct.pack("!I", round(frames * self.clock / 1000)))
+        elif op == client.OP_TRIGGER and len(payload) == 5:
+            (threshold, pretrigger, ms) = struct.unpack("!HBH", payload)
+            wait = ms * (F_CPU // 1000) // SAMPLE_CYCLES
+            if pretrigger > client.TRIGGER_MAX_PRETRIGGER or (threshold and (wait == 0 or ms > client.TRIGGER_MAX_WAIT)):
+                self.respond(seq, op, client.STATUS_REJECT)
+                return
+            self.trigger = (threshold, pretrigger, wait) if threshold else None
+            self.respond(seq, op, client.STATUS_ACCEPT)
+        elif op == client.OP_MONITOR and not payload:
+            self.respond(seq, op, client.STATUS_ACCEPT)
+            self.monitoring = True
+            self.monitor_sample = 0
+            self.monitor_flips = [self.random.uniform(0, self.frame())]
+            self.monitor_high = False
+        elif op == client.OP_CALIBRATE:
+            self.respond(seq, op, client.STATUS_ACCEPT)
+            self.calibrate()
+        elif op == client.OP_MEASURE and self.has_trigger and len(payload) <= 1:
+            reset = bool(payload and payload[0] & client.MEASURE_RESET)
+            if reset and not self.has_reset:
+                self.respond(seq, op, client.STATUS_REJECT)
+                return
+            self.respond(seq, op, client.STATUS_ACCEPT)
+            flips = self.shown([0])
+            if self.truth is not None and flips:
+                self.truth(flips[0] + self.model.midpoint() - FIRST_SAMPLE)
+            # The reset goes back from the level the trigger left behind
+            self.stream(flips, MEASURE_SAMPLES, [], self.shown([0]) if reset else None, len(flips) % 2 == 1)
+        elif op == client.OP_BURST and self.has_trigger and len(payload) == 4:
+            (keys, period) = struct.unpack("!HH", payload)
+            if not 0 < keys * period <= client.BURST_MAX_MS:
+                self.respond(seq, op, client.STATUS_REJECT)
+                return
+            half = period / 1000 / 2 * F_CPU
+            events = [round(half * i) for i in range(2 * keys)]
+            samples = round((events[-1] + BURST_TAIL * F_CPU) / SAMPLE_CYCLES)
+            self.respond(seq, op, client.STATUS_ACCEPT)
+            self.stream(self.shown(events[::2]), samples, events[1:])
+        else:
+            self.respond(seq, op, client.STATUS_REJECT)
+
+    def shown(self, keys):
+        # Cycle at which each key reaches the screen. Keys that make it into
+        # the same frame cancel out, so only odd counts per frame flip the
+        # light
+        ready = [key + self.model.delay(self.random) * F_CPU for key in keys]
+        if not self.model.refresh:
+            return sorted(ready)
+
+        frame = F_CPU / self.model.refresh
+        offset = self.random.uniform(0, frame)
+        frames = {}
+        for time in ready:
+            index = int((time + offset) // frame) + 1
+            frames[index] = frames.get(index, 0) + 1
+        return [index * frame - offset for (index, count) in sorted(frames.items()) if count % 2]
+
+    def levels(self, times, flips, start_high=False):
+        # Every flip ramps the light over to the other level
+        (low, high) = (self.model.low, self.model.high)
+        target = high if start_high else low
+        level = np.full(len(times), float(target))
+        for flip in flips:
+            (start, target) = (target, high if target == low else low)
+            after = times >= flip
+            level[after] = start + (target - start) * self.model.step(times[after] - flip)
+
+        if self.model.pwm:
+            period = F_CPU / self.model.pwm
+            phase = self.random.uniform(0, period)
+            dim = ((times + phase) % period) >= period / 2
+            level *= 1 - self.model.pwm_depth * dim
+
+        level += self.noise.normal(0, self.model.noise, len(times))
+        return np.clip(np.round(level), 0, 1023).astype(int)
+
+    def records(self, times, values):
+        return np.stack([times & 0xFFFF, values], axis=1).astype(">u2").tobytes()
+
+    def stream(self, flips, samples, events, reset=None, reset_high=False):
+        # Variance, the upper half of the time and then the samples, just like
+        # doMeasure. reset are the flips of the reset step if it's measured
+        # too, starting from the high level if reset_high
+        self.output += struct.pack("!H", self.random.randrange(1000, 16000))
+        self.segment(flips, samples, events)
+        if reset is not None:
+            self.output += struct.pack("!HH", self.random.randrange(1000, 16000), client.SEGMENT_RESET)
+            self.segment(reset, MEASURE_SAMPLES, [], reset_high)
+        self.output += client.SUCCESS
+
+    def segment(self, flips, samples, events, start_high=False):
+        if self.trigger is not None and not events:
+            self.armed(flips, samples, start_high)
+            return
+        self.output += struct.pack("!HH", 0, client.TIME_HIGH)
+
+        times = FIRST_SAMPLE + np.arange(samples, dtype=np.int64) * SAMPLE_CYCLES
+        values = self.levels(times, flips, start_high)
+        # Mark the first sample at or after every report
+        marked = np.searchsorted(times, events)
+        values[marked[marked < samples]] |= client.BURST_MARK
+
+        self.output += self.records(times, values)
+        self.output += self.telemetry(times[-1])
+
+    def armed(self, flips, samples, start_high):
+        # Like doMeasure with a threshold: the samples up to the one that moved
+        # far enough from the light before the key, or the last one of the
+        # wait, stay in a ring. The stream starts after it and the ring comes
+        # after the stream
+        (threshold, pretrigger, wait) = self.trigger
+        times = FIRST_SAMPLE + np.arange(-1, wait + samples, dtype=np.int64) * SAMPLE_CYCLES
+        values = self.levels(times, flips, start_high)
+        moved = np.abs(values[1:wait + 1] - values[0]) >= threshold
+        trigger = int(np.argmax(moved)) + 1 if np.any(moved) else wait
+        first = max(1, trigger - pretrigger)
+
+        stream = slice(trigger + 1, trigger + 1 + samples)
+        self.output += struct.pack("!HH", times[stream][0] >> 16, client.TIME_HIGH)
+        self.output += self.records(times[stream], values[stream])
+        self.output += struct.pack("!HH", times[first] >> 16, client.TIME_HIGH)
+        self.output += self.records(times[first:trigger + 1], values[first:trigger + 1])
+        self.output += self.telemetry(times[stream][-1] - times[1], {
+            client.TELEMETRY_SKIPPED: first - 1,
+            client.TELEMETRY_TRIGGER_TIMEOUT: int(trigger == wait),
+        })
+
+    def telemetry(self, elapsed, extra={}):
+        # A host polling every millisecond, and a device that kept up
+        start = self.random.randrange(client.FRAME_NUMBERS)
+        end = (start + int(elapsed // client.FRAME_CYCLES)) % client.FRAME_NUMBERS
+        values = {
+            client.TELEMETRY_POLL_LATENCY: self.random.randrange(client.FRAME_CYCLES),
+            client.TELEMETRY_OVERRUNS: 0,
+            client.TELEMETRY_FRAME_START: start,
+            client.TELEMETRY_FRAME_END: end,
+            client.TELEMETRY_HID_TIMEOUT: 0,
+            **extra,
+        }
+        return b"".join(struct.pack("!HH", value, kind) for (kind, value) in values.items())
+
+    def frame(self):
+        # Cycles per refresh of the animation
+        return F_CPU / (self.model.refresh or 60)
+
+    def monitor(self, blocks):
+        # Appends the next blocks of the monitoring stream to the output
+        samples = blocks * client.MONITOR_BLOCK
+        times = (self.monitor_sample + np.arange(samples, dtype=np.int64)) * client.MONITOR_SAMPLE_CYCLES
+        self.monitor_sample += samples
+
+        flips = self.monitor_flips
+        while flips[-1] <= times[-1]:
+            flips.append(flips[-1] + self.frame() * (2 if self.random.random() < self.model.stutter else 1))
+        values = self.levels(times, flips, self.monitor_high).reshape(blocks, -1)
+
+        # Only the last flip before the end can still be ramping
+        done = max(0, len(flips) - 2)
+        self.monitor_high ^= done % 2 == 1
+        del flips[:done]
+
+        self.output += frametime.pack_blocks(times[::client.MONITOR_BLOCK], values)
+
+    def calibrate(self):
+        self.output += struct.pack("!HH", 0, client.TIME_HIGH)
+        times = np.arange(CALIBRATE_SAMPLES, dtype=np.int64) * SAMPLE_CYCLES
+        self.output += self.records(times, self.levels(times, []))
+        self.output += client.SUCCESS
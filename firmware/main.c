@@ -8,20 +8,23 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <ctype.h>
 #include <string.h>
 #include <iso646.h>
 
 #include "usb_serial.h"
-
-#define STRINGIFY(x) #x
-#define TOSTRING(x) STRINGIFY(x)
+#include "protocol.h"
 
 #define LSB(n) (n & 255)
 #define MSB(n) ((n >> 8) & 255)
 
-uint8_t test_kc;
-uint8_t reset_kc;
+struct Step {
+	uint8_t flags;
+	uint16_t delay;
+	uint8_t report[STEP_KEYBOARD_REPORT];
+};
+
+static struct Step sequence[SEQUENCE_MAX_STEPS];
+static uint8_t sequence_len;
 
 static void enableTimer() {
 	// Enable Timer 1 with a 1/1 clock
@@ -38,56 +41,116 @@ static void resetTimer() {
 	TIFR1 |= _BV(TOV1);
 }
 
+// Upper half of the 32 bit time. Only counted while the overflow interrupt is
+// enabled, doMeasure keeps its own count since it runs without interrupts
+static volatile uint16_t timer_high;
+
+ISR(TIMER1_OVF_vect) {
+	timer_high++;
+}
+
+static uint32_t readTimer() {
+	uint8_t intr_state = SREG;
+	cli();
+	uint16_t low = TCNT1;
+	uint16_t high = timer_high;
+	// The timer might have wrapped after we disabled interrupts. If the
+	// overflow is still pending and the time we read is low, it happened
+	// before we read it
+	if((TIFR1 & _BV(TOV1)) && low < 0x8000) {
+		high++;
+	}
+	SREG = intr_state;
+	return ((uint32_t)high << 16) | low;
+}
+
 static void pgm_send_str(const char *s) {
-	char c;
-	while (1) {
-		c = pgm_read_byte(s++);
-		if (!c) break;
-		usb_serial_putchar(c);
+	usb_serial_write_P(s, strlen_P(s));
+}
+
+struct Command {
+	uint8_t seq;
+	uint8_t op;
+	uint8_t len;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+};
+
+// Blocks until a byte arrives. Returns -1 if the host went away
+static int16_t recv_byte() {
+	while(1) {
+		int16_t r = usb_serial_getchar();
+		if (r != -1) return r;
+		if (!usb_configured() || !(usb_serial_get_control() & USB_SERIAL_DTR)) {
+			// user no longer connected
+			return -1;
+		}
+		// just a normal timeout, keep waiting
 	}
 }
 
-static uint8_t recv_str(char *buf, uint8_t size) {
+// Read the next command frame. Returns 255 if the host disconnected
+static uint8_t recv_command(struct Command* cmd) {
 	int16_t r;
-	uint8_t count=0;
-
-	while (count < size) {
-		r = usb_serial_getchar();
-		if (r != -1) {
-			if (r == '\r' || r == '\n') return count;
-			if (r >= ' ' && r <= '~') {
-				*buf++ = r;
-				count++;
-			}
-		} else {
-			if (!usb_configured() || !(usb_serial_get_control() & USB_SERIAL_DTR)) {
-				// user no longer connected
-				return 255;
-			}
-			// just a normal timeout, keep waiting
-		}
+	// Skip anything up to the start of a frame, that way we find our footing
+	// again if we ever lose it
+	do {
+		r = recv_byte();
+		if (r == -1) return 255;
+	} while (r != FRAME_COMMAND);
+
+	uint8_t header[FRAME_HEADER_COMMAND - 1];
+	for (uint8_t i = 0; i < sizeof(header); i++) {
+		if ((r = recv_byte()) == -1) return 255;
+		header[i] = r;
+	}
+	cmd->seq = header[0];
+	cmd->op = header[1];
+	cmd->len = header[2];
+
+	for (uint8_t i = 0; i < cmd->len; i++) {
+		if ((r = recv_byte()) == -1) return 255;
+		// Too long payloads are drained, and then rejected by the caller
+		if (i < FRAME_MAX_PAYLOAD) cmd->payload[i] = r;
 	}
-	return count;
+	return 0;
 }
 
-static inline uint8_t emitLevel(uint16_t level) {
-	uint16_t time = TCNT1;
-	uint8_t overflow = TIFR1 & _BV(TOV1);
-	resetTimer();
+static void send_response(const struct Command* cmd, uint8_t status, const uint8_t* payload, uint8_t len) {
+	uint8_t header[FRAME_HEADER_RESPONSE] = {FRAME_RESPONSE, cmd->seq, cmd->op, status, len};
+	usb_serial_write(header, sizeof(header));
+	usb_serial_write(payload, len);
+}
 
-	usb_serial_putchar(MSB(time));
-	usb_serial_putchar(LSB(time));
+static inline uint8_t emitRecord(uint16_t time, uint16_t value) {
+	uint8_t record[4] = {MSB(time), LSB(time), MSB(value), LSB(value)};
+	return usb_serial_write(record, sizeof(record)) != 0;
+}
+
+// Emit a level along with the lower half of the current time. The upper half
+// is sent along whenever it changed since the last level, since the serial
+// writes can stall for longer than the timer takes to wrap
+static inline uint8_t emitLevel(uint16_t level, uint16_t* high) {
+	uint32_t now = readTimer();
+	uint8_t err = 0;
 
-	usb_serial_putchar(MSB(level));
-	usb_serial_putchar(LSB(level));
+	if((now >> 16) != *high) {
+		*high = now >> 16;
+		err |= emitRecord(*high, TIME_HIGH);
+	}
 
-	return overflow;
+	err |= emitRecord(now, level);
+	return err;
 }
 
 static uint8_t doCalibrate() {
 	uint8_t err = 0;
 	enableTimer();
 	resetTimer();
+	timer_high = 0;
+	TIMSK1 = _BV(TOIE1);
+
+	err |= emitRecord(0, TIME_HIGH);
+	uint16_t high = 0;
 	for(uint16_t i = 0; i < 100; i++) {
 		// Start an ADC conversion by setting ADSC bit (bit 6)
 		ADCSRA |= _BV(ADSC);
@@ -95,15 +158,395 @@ static uint8_t doCalibrate() {
 		loop_until_bit_is_clear(ADCSRA, ADSC);
 		uint16_t val = ADCL | (ADCH << 8);
 
-		err |= emitLevel(val);
+		err |= emitLevel(val, &high);
+	}
+	usb_serial_flush_output();
+
+	TIMSK1 = 0;
+	disableTimer();
+	return err;
+}
+
+// Passive monitoring. The ADC runs free and its interrupt keeps the samples in a
+// ring of two blocks, along with the time of the first sample of each. If the
+// host falls behind and the ring runs full, it starts over and drops what it
+// held
+#define MONITOR_RING (2 * MONITOR_BLOCK)
+static uint16_t monitor_ring[MONITOR_RING];
+static uint32_t monitor_times[2];
+static volatile uint8_t monitor_head;
+static volatile uint8_t monitor_count;
+
+ISR(ADC_vect) {
+	if(monitor_count == MONITOR_RING) {
+		monitor_head = 0;
+		monitor_count = 0;
+	}
+	if(monitor_head % MONITOR_BLOCK == 0) {
+		monitor_times[monitor_head / MONITOR_BLOCK] = readTimer();
+	}
+	// ADCL has to be read first
+	uint8_t low = ADCL;
+	monitor_ring[monitor_head] = low | (ADCH << 8);
+	monitor_head = (monitor_head + 1) % MONITOR_RING;
+	monitor_count++;
+}
+
+// Streams blocks of samples until the host sends something, see OP_MONITOR
+static uint8_t doMonitor() {
+	enableTimer();
+	resetTimer();
+	timer_high = 0;
+	TIMSK1 = _BV(TOIE1);
+	monitor_head = 0;
+	monitor_count = 0;
+	// Free running, every conversion starts the next one
+	ADCSRA |= _BV(ADEN) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) | _BV(ADSC);
+
+	uint8_t err = 0;
+	while(!err && !usb_serial_available()) {
+		if (!usb_configured() || !(usb_serial_get_control() & USB_SERIAL_DTR)) break;
+
+		uint16_t samples[MONITOR_BLOCK];
+		uint32_t time = 0;
+		uint8_t intr_state = SREG;
+		cli();
+		uint8_t count = monitor_count;
+		if(count >= MONITOR_BLOCK) {
+			uint8_t start = (monitor_head + MONITOR_RING - count) % MONITOR_RING;
+			time = monitor_times[start / MONITOR_BLOCK];
+			memcpy(samples, &monitor_ring[start], sizeof(samples));
+			monitor_count -= MONITOR_BLOCK;
+		}
+		SREG = intr_state;
+		if(count < MONITOR_BLOCK) continue;
+
+		uint8_t block[6 + MONITOR_BLOCK * 5 / 4] = {MSB(MONITOR_SYNC), LSB(MONITOR_SYNC), time >> 24, time >> 16, time >> 8, time};
+		uint8_t* packed = block + 6;
+		for(uint8_t i = 0; i < MONITOR_BLOCK; i += 4) {
+			uint8_t low = 0;
+			for(uint8_t j = 0; j < 4; j++) {
+				*packed++ = samples[i + j] >> 2;
+				low = (low << 2) | (samples[i + j] & 3);
+			}
+			*packed++ = low;
+		}
+		err = usb_serial_write(block, sizeof(block)) != 0;
 	}
+
+	ADCSRA &= compl (_BV(ADATE) | _BV(ADIE));
+	loop_until_bit_is_clear(ADCSRA, ADSC);
+	ADCSRA |= _BV(ADIF);
+	TIMSK1 = 0;
+	disableTimer();
 	usb_serial_flush_output();
+	return err;
+}
+
+// Give up on measuring the clock if no start of frame packet came for this
+// many cycles, about 10 frames
+#define CLOCK_TIMEOUT (F_CPU / 100)
+
+// Start of frame packets left to count, and the times of the first and the
+// last one counted
+static volatile uint16_t clock_left;
+static uint16_t clock_frames;
+static volatile uint32_t clock_first;
+static volatile uint32_t clock_last;
+
+// Called from the USB interrupt on every start of frame packet
+static void clockFrame() {
+	uint16_t left = clock_left;
+	if(!left) return;
+	uint32_t now = readTimer();
+	if(left > clock_frames) clock_first = now;
+	clock_last = now;
+	clock_left = left - 1;
+}
+
+// Counts the cycles between frames start of frame packets. The USB interrupt
+// times them, so the control endpoint is still served in the meantime.
+// Returns false if they stop coming
+static bool measureClock(uint16_t frames, uint32_t* cycles) {
+	enableTimer();
+	resetTimer();
+	timer_high = 0;
+	TIMSK1 = _BV(TOIE1);
+
+	// One more packet to start on
+	clock_frames = frames;
+	clock_left = frames + 1;
+	clock_last = 0;
+	uint8_t intr_state = SREG;
+	cli();
+	usb_frame_hook = clockFrame;
+	SREG = intr_state;
+
+	bool ok = true;
+	while(ok) {
+		cli();
+		uint16_t left = clock_left;
+		uint32_t last = clock_last;
+		SREG = intr_state;
+		if(!left) break;
+		ok = readTimer() - last < CLOCK_TIMEOUT;
+	}
 
+	cli();
+	usb_frame_hook = NULL;
+	clock_left = 0;
+	SREG = intr_state;
+	TIMSK1 = 0;
 	disableTimer();
+
+	*cycles = clock_last - clock_first;
+	return ok;
+}
+
+static uint8_t reportLen(const struct Step* step) {
+	return (step->flags & STEP_MOUSE) ? STEP_MOUSE_REPORT : STEP_KEYBOARD_REPORT;
+}
+
+// The report the device is holding right now, as the given step would send it
+static void heldReport(const struct Step* step, uint8_t* report) {
+	if(step->flags & STEP_MOUSE) {
+		// Movement is relative, so only the buttons stay held
+		report[0] = mouse_report[0];
+		report[1] = 0;
+		report[2] = 0;
+		report[3] = 0;
+	} else {
+		report[0] = keyboard_modifier;
+		report[1] = 0;
+		memcpy(report + 2, keyboard_keys, 6);
+	}
+}
+
+static void playStep(const struct Step* step) {
+	if(step->flags & STEP_MOUSE) {
+		memcpy(mouse_report, step->report, STEP_MOUSE_REPORT);
+		usb_mouse_send();
+		// Don't move again when the buttons are sent next time
+		memset(mouse_report + 1, 0, STEP_MOUSE_REPORT - 1);
+	} else {
+		keyboard_modifier = step->report[0];
+		memcpy(keyboard_keys, step->report + 2, 6);
+		usb_keyboard_send();
+	}
+
+	for(uint16_t i = 0; i < step->delay; i++) {
+		_delay_ms(1);
+	}
+}
+
+static void releaseAll() {
+	keyboard_modifier = 0;
+	memset(keyboard_keys, 0, 6);
+	usb_keyboard_send();
+	memset(mouse_report, 0, STEP_MOUSE_REPORT);
+	usb_mouse_send();
+}
+
+static void addStep(uint8_t flags, uint16_t delay, uint8_t modifier, uint8_t key) {
+	struct Step* step = &sequence[sequence_len++];
+	step->flags = flags;
+	step->delay = delay;
+	memset(step->report, 0, sizeof(step->report));
+	step->report[0] = modifier;
+	step->report[2] = key;
+}
+
+// Length of one pass through the sample loop in measure.S
+#define SAMPLE_CYCLES 896
+// Samples in ms milliseconds, rounded down
+#define MS_SAMPLES(ms) ((uint32_t)(ms) * (F_CPU / 1000) / SAMPLE_CYCLES)
+#define MEASURE_SAMPLES 1024
+// How long to keep watching after the last report of a burst
+#define BURST_TAIL_MS 200
+
+extern uint8_t doMeasure(uint8_t ep, const uint8_t* reports, uint8_t len, uint16_t samples, uint16_t events, uint16_t interval, uint16_t segment);
+
+// Filled in by doMeasure
+int8_t measure_ready;
+uint16_t measure_poll_start;
+uint16_t measure_poll_end;
+uint8_t measure_poll_overflows;
+uint16_t measure_overruns;
+uint16_t measure_frame_start;
+uint16_t measure_frame_end;
+
+// Set for doMeasure, a threshold of 0 streams from the first sample
+uint16_t measure_threshold;
+uint16_t measure_wait;
+uint8_t measure_ring_len;
+uint8_t measure_ring[4 * (TRIGGER_MAX_PRETRIGGER + 1)];
+// Filled in by doMeasure when it had a threshold. The byte after the newest
+// record in the ring, the number of records in it, the upper half of the time
+// of the first sample streamed and the samples left of the wait
+uint8_t measure_ring_pos;
+uint8_t measure_ring_fill;
+uint16_t measure_high;
+uint16_t measure_left;
+
+// What OP_TRIGGER asked for, the wait in samples
+static uint16_t trigger_threshold;
+static uint8_t trigger_pretrigger;
+static uint16_t trigger_wait;
+
+// Sends the records doMeasure held back in the ring, oldest first, and counts
+// the samples before them in skipped
+static uint8_t emitPretrigger(uint16_t* skipped) {
+	uint8_t len = measure_ring_len;
+	uint8_t count = measure_ring_fill;
+	uint8_t newest = (measure_ring_pos / 4 + len - 1) % len;
+	uint8_t oldest = (newest + len + 1 - count) % len;
+	*skipped = measure_wait - measure_left - count;
+
+	// The ring spans less than the timer takes to wrap, so its records are
+	// in the upper half of the first streamed sample, or the one before
+	const uint8_t* record = &measure_ring[4 * oldest];
+	uint16_t first = (record[0] << 8) | record[1];
+	uint16_t next = ((measure_ring[4 * newest] << 8) | measure_ring[4 * newest + 1]) + SAMPLE_CYCLES;
+	uint16_t high = measure_high - (first > next);
+
+	uint8_t err = emitRecord(high, TIME_HIGH);
+	for(uint8_t i = 0; i < count; i++) {
+		err |= usb_serial_write(&measure_ring[4 * ((oldest + i) % len)], 4) != 0;
+	}
+	return err;
+}
+
+static uint8_t emitTelemetry(uint16_t skipped) {
+	// The timer runs free, so the poll took end - start cycles as long as it
+	// didn't wrap around more than once
+	uint16_t latency = measure_poll_end - measure_poll_start;
+	if(measure_poll_overflows > 1 || (measure_poll_overflows == 1 && measure_poll_end >= measure_poll_start)) {
+		latency = 0xFFFF;
+	}
+
+	uint8_t err = 0;
+	err |= emitRecord(latency, TELEMETRY_POLL_LATENCY);
+	err |= emitRecord(measure_overruns, TELEMETRY_OVERRUNS);
+	err |= emitRecord(measure_frame_start, TELEMETRY_FRAME_START);
+	err |= emitRecord(measure_frame_end, TELEMETRY_FRAME_END);
+	err |= emitRecord(measure_ready != 0, TELEMETRY_HID_TIMEOUT);
+	if(measure_threshold) {
+		err |= emitRecord(skipped, TELEMETRY_SKIPPED);
+		err |= emitRecord(measure_left == 0, TELEMETRY_TRIGGER_TIMEOUT);
+	}
+	return err;
+}
+
+// Index of the step the measurement is timed from, 255 if there is none
+static uint8_t findTrigger() {
+	uint8_t trigger = 255;
+	for(uint8_t i = 0; i < sequence_len; i++) {
+		if(!(sequence[i].flags & STEP_RESET)) trigger = i;
+	}
+	return trigger;
+}
+
+// The key alternated with the trigger in a burst. That's the first reset
+// step, as long as it's for the same device, or the trigger itself otherwise
+static const struct Step* findAlternate(uint8_t trigger) {
+	for(uint8_t i = 0; i < sequence_len; i++) {
+		if(!(sequence[i].flags & STEP_RESET)) continue;
+		if((sequence[i].flags & STEP_MOUSE) != (sequence[trigger].flags & STEP_MOUSE)) break;
+		return &sequence[i];
+	}
+	return &sequence[trigger];
+}
+
+// Samples between the reports of a burst of keys, each taking period ms, and
+// the number of samples the whole burst needs. Returns false if it doesn't fit
+// in a single measurement or takes longer than BURST_MAX_MS
+static bool burstTiming(uint16_t keys, uint16_t period, uint16_t* interval, uint16_t* samples) {
+	if((uint32_t)keys * period > BURST_MAX_MS) return false;
+	// Every key is a press followed by a release half a period later
+	uint32_t half = MS_SAMPLES(period) / 2;
+	uint32_t total = half * (2 * (uint32_t)keys - 1) + MS_SAMPLES(BURST_TAIL_MS);
+	if(keys == 0 || half == 0 || half > 0xFFFF || total > 0xFFFF) return false;
+	*interval = half;
+	*samples = total;
+	return true;
+}
+
+// Index of the first reset step, 255 if there is none
+static uint8_t findReset() {
+	for(uint8_t i = 0; i < sequence_len; i++) {
+		if(sequence[i].flags & STEP_RESET) return i;
+	}
+	return 255;
+}
+
+// Measures a step, followed by its telemetry. With keys set the step is
+// alternated with the alternate step that many times, period ms apart.
+// segment is 0 for the first segment of a run
+static uint8_t measureStep(const struct Step* step, const struct Step* alternate, uint16_t keys, uint16_t period, uint16_t segment) {
+	uint8_t len = reportLen(step);
+	// The idle report, the step, and for a burst the idle report again and
+	// the alternate key
+	uint8_t reports[4 * STEP_KEYBOARD_REPORT];
+	heldReport(step, reports);
+	memcpy(reports + len, step->report, len);
+	memcpy(reports + 2 * len, reports, len);
+	memcpy(reports + 3 * len, alternate->report, len);
+	uint8_t ep = (step->flags & STEP_MOUSE) ? USB_MOUSE_ENDPOINT : USB_KEYBOARD_ENDPOINT;
+
+	uint8_t err;
+	uint16_t skipped = 0;
+	if(keys) {
+		uint16_t interval;
+		uint16_t samples;
+		burstTiming(keys, period, &interval, &samples);
+		measure_threshold = 0;
+		err = doMeasure(ep, reports, len, samples, 2 * keys - 1, interval, segment);
+	} else {
+		measure_threshold = trigger_threshold;
+		measure_wait = trigger_wait;
+		measure_ring_len = trigger_pretrigger + 1;
+		err = doMeasure(ep, reports, len, MEASURE_SAMPLES, 0, 0, segment);
+		if(measure_threshold) err |= emitPretrigger(&skipped);
+	}
+	err |= emitTelemetry(skipped);
+
+	// The measurement already released the step. Wait out its delay before
+	// going on
+	for(uint16_t i = 0; i < step->delay; i++) {
+		_delay_ms(1);
+	}
 	return err;
 }
 
-extern uint8_t doMeasure(uint8_t key, uint8_t reset);
+// Plays the sequence and measures the trigger. With keys set the trigger is
+// alternated with the reset key that many times, period ms apart. With reset
+// set the first reset step is measured too, in a segment of its own
+static uint8_t runSequence(uint16_t keys, uint16_t period, bool reset) {
+	uint8_t trigger = findTrigger();
+
+	for(uint8_t i = 0; i < trigger; i++) {
+		if(!(sequence[i].flags & STEP_RESET)) playStep(&sequence[i]);
+	}
+
+	uint8_t err = measureStep(&sequence[trigger], findAlternate(trigger), keys, period, 0);
+
+	// A burst with an even number of keys undid itself, its last key was
+	// the alternate
+	if(keys == 0 || (keys & 1)) {
+		uint8_t i = 0;
+		if(reset) {
+			i = findReset();
+			err |= measureStep(&sequence[i], &sequence[i], 0, 0, SEGMENT_RESET);
+			i++;
+		}
+		for(; i < sequence_len; i++) {
+			if(sequence[i].flags & STEP_RESET) playStep(&sequence[i]);
+		}
+	}
+	releaseAll();
+
+	return err;
+}
 
 int main ()
 {
@@ -136,7 +579,7 @@ int main ()
 
 	while(!usb_configured()) ;
 
-	char buf[32];
+	struct Command cmd;
 	while(1) {
 		// Wait for the user to run their terminal emulator program which sets
 		// DTR to indicate it is ready to receive.
@@ -146,76 +589,124 @@ int main ()
 		// system or other software will send a modem "AT command", which can
 		// still be buffered.
 		usb_serial_flush_input();
+		// A new host starts without a trigger
+		trigger_threshold = 0;
 
-		pgm_send_str(PSTR("HELO ScreenTimer ready\n"));
+		cmd.seq = 0;
+		cmd.op = OP_HELLO;
+		send_response(&cmd, STATUS_ACCEPT, (const uint8_t*)"ScreenTimer", 11);
+		usb_serial_flush_output();
 
 		while(1) {
-			uint8_t n = recv_str(buf, sizeof(buf));
-			if (n == 255) break;
+			if (recv_command(&cmd) == 255) break;
 
-			if(n < 1) {
-				pgm_send_str(PSTR("REJT\n"));
-				continue;
-			}
-
-			if(buf[0] == 'C') {
-				pgm_send_str(PSTR("CSTA\n"));
+			if(cmd.len > FRAME_MAX_PAYLOAD) {
+				send_response(&cmd, STATUS_REJECT, NULL, 0);
+			} else if(cmd.op == OP_CALIBRATE) {
+				send_response(&cmd, STATUS_ACCEPT, NULL, 0);
 				if(doCalibrate()) {
 					pgm_send_str(PSTR("\xFF\xFF\xFF\xFF"));
 				} else {
 					pgm_send_str(PSTR("\xFF\xFF\xFF\xFE"));
 				}
-			} else if(buf[0] == 'M') {
-				pgm_send_str(PSTR("MSTA\n"));
-				if(doMeasure(test_kc, reset_kc)) {
-					pgm_send_str(PSTR("\xFF\xFF\xFF\xFF"));
+			} else if(cmd.op == OP_MEASURE) {
+				uint8_t flags = cmd.len ? cmd.payload[0] : 0;
+				if(cmd.len > 1 || findTrigger() == 255 || ((flags & MEASURE_RESET) && findReset() == 255)) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
 				} else {
-					pgm_send_str(PSTR("\xFF\xFF\xFF\xFE"));
+					send_response(&cmd, STATUS_ACCEPT, NULL, 0);
+					if(runSequence(0, 0, flags & MEASURE_RESET)) {
+						pgm_send_str(PSTR("\xFF\xFF\xFF\xFF"));
+					} else {
+						pgm_send_str(PSTR("\xFF\xFF\xFF\xFE"));
+					}
 				}
-			} else if(buf[0] == 'I') {
-				// Write out the firmware configured CPU speed. It would be
-				// better to get the ACTUAL CPU speed
-				pgm_send_str(PSTR("RESL " TOSTRING(F_CPU) "\n"));
-			} else if(buf[0] == 'K') {
-				if(n < 3 || buf[1] != ' ' || n >= sizeof(buf)) {
-					pgm_send_str(PSTR("REJT\n"));
-					continue;
+			} else if(cmd.op == OP_BURST) {
+				uint16_t keys = (cmd.payload[0] << 8) | cmd.payload[1];
+				uint16_t period = (cmd.payload[2] << 8) | cmd.payload[3];
+				uint16_t interval;
+				uint16_t samples;
+				if(cmd.len != 4 || findTrigger() == 255 || !burstTiming(keys, period, &interval, &samples)) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
+				} else {
+					send_response(&cmd, STATUS_ACCEPT, NULL, 0);
+					if(runSequence(keys, period, false)) {
+						pgm_send_str(PSTR("\xFF\xFF\xFF\xFF"));
+					} else {
+						pgm_send_str(PSTR("\xFF\xFF\xFF\xFE"));
+					}
 				}
-
-				char* strend = buf + n;
-				char* cursor = buf + 2;
-				if(!isdigit(*cursor)) {
-					pgm_send_str(PSTR("REJT\n"));
-					continue;
+			} else if(cmd.op == OP_MONITOR) {
+				if(cmd.len != 0) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
+				} else {
+					send_response(&cmd, STATUS_ACCEPT, NULL, 0);
+					if(doMonitor()) {
+						pgm_send_str(PSTR("\xFF\xFF\xFF\xFF"));
+					} else {
+						pgm_send_str(PSTR("\xFF\xFF\xFF\xFE"));
+					}
 				}
-
-				char* firstarg = cursor;
-				while(cursor != strend && isdigit(*cursor)) {
-					cursor++;
+			} else if(cmd.op == OP_INFO) {
+				// Write out the firmware configured CPU speed. OP_CLOCK
+				// measures the actual one
+				uint32_t f_cpu = F_CPU;
+				uint8_t payload[4] = {f_cpu >> 24, f_cpu >> 16, f_cpu >> 8, f_cpu};
+				send_response(&cmd, STATUS_ACCEPT, payload, sizeof(payload));
+			} else if(cmd.op == OP_CLOCK) {
+				uint16_t frames = (cmd.payload[0] << 8) | cmd.payload[1];
+				uint32_t cycles;
+				if(cmd.len != 2 || frames == 0 || frames > CLOCK_MAX_FRAMES || !measureClock(frames, &cycles)) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
+				} else {
+					uint8_t payload[4] = {cycles >> 24, cycles >> 16, cycles >> 8, cycles};
+					send_response(&cmd, STATUS_ACCEPT, payload, sizeof(payload));
 				}
-
-				if(cursor == strend || *cursor != ' ') {
-					pgm_send_str(PSTR("REJT\n"));
-					continue;
+			} else if(cmd.op == OP_TRIGGER) {
+				uint16_t threshold = (cmd.payload[0] << 8) | cmd.payload[1];
+				uint8_t pretrigger = cmd.payload[2];
+				uint16_t ms = (cmd.payload[3] << 8) | cmd.payload[4];
+				uint32_t wait = MS_SAMPLES(ms);
+				if(cmd.len != 5 || pretrigger > TRIGGER_MAX_PRETRIGGER || (threshold && (wait == 0 || ms > TRIGGER_MAX_WAIT))) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
+				} else {
+					trigger_threshold = threshold;
+					trigger_pretrigger = pretrigger;
+					trigger_wait = wait;
+					send_response(&cmd, STATUS_ACCEPT, NULL, 0);
 				}
-				cursor++;
+			} else if(cmd.op == OP_KEYCODES) {
+				if(cmd.len != 2) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
+				} else {
+					sequence_len = 0;
+					addStep(0, 0, 0, cmd.payload[0]);
+					addStep(STEP_RESET, 0, 0, cmd.payload[1]);
 
-				if(cursor == strend || !isdigit(*cursor)) {
-					pgm_send_str(PSTR("REJT\n"));
-					continue;
+					send_response(&cmd, STATUS_ACCEPT, NULL, 0);
 				}
-
-				char* secondarg = cursor;
-				while(cursor != strend && isdigit(*cursor)) {
-					cursor++;
+			} else if(cmd.op == OP_SEQUENCE) {
+				uint8_t index = cmd.payload[0];
+				uint8_t flags = cmd.payload[1];
+				uint8_t len = (flags & STEP_MOUSE) ? STEP_MOUSE_REPORT : STEP_KEYBOARD_REPORT;
+				if(cmd.len != STEP_HEADER + len || (index != 0 && index != sequence_len) || index >= SEQUENCE_MAX_STEPS) {
+					send_response(&cmd, STATUS_REJECT, NULL, 0);
+				} else {
+					sequence_len = index;
+					struct Step* step = &sequence[sequence_len++];
+					step->flags = flags;
+					step->delay = (cmd.payload[2] << 8) | cmd.payload[3];
+					memset(step->report, 0, sizeof(step->report));
+					memcpy(step->report, cmd.payload + STEP_HEADER, len);
+
+					send_response(&cmd, STATUS_ACCEPT, NULL, 0);
 				}
-				*cursor = '\0';
-
-				test_kc = atoi(firstarg);
-				reset_kc = atoi(secondarg);
-
-				pgm_send_str(PSTR("ACPT\n"));
+			} else {
+				send_response(&cmd, STATUS_REJECT, NULL, 0);
 			}
+			// Don't leave the answer waiting for the flush timeout, the host
+			// might be waiting for it
+			usb_serial_flush_output();
 		}
 	}
 
@@ -0,0 +1,137 @@
+#pragma once
+// Shared between the C code and measure.S, so only preprocessor definitions go
+// in here.
+
+// Samples are streamed as 4 byte records, a 16 bit time followed by a 16 bit
+// value. The ADC only gives us 10 bits, so values with the top bits set are
+// free to mean something else.
+
+// The time field of this record holds the upper 16 bits of the timer for the
+// records that follow it. Records only carry the lower 16 bits, when those wrap
+// without a new TIME_HIGH record the host adds one to the upper half itself.
+#define TIME_HIGH 0xFFFD
+
+// After the samples of a measurement, and before the terminator, the device
+// reports on how the measurement went. These records hold a 16 bit number in
+// the time field and what it is in the value field. They stay clear of
+// TIME_HIGH and the terminators.
+// Cycles from sending the idle report until the host picked it up, 0xFFFF if
+// it took longer than that
+#define TELEMETRY_POLL_LATENCY 0xFFE0
+// Times the sample loop found the serial buffer still full when flushing. The
+// loop doesn't wait for it, so the period stays the same and every one of them
+// lost the records written until the buffer was free again
+#define TELEMETRY_OVERRUNS 0xFFE1
+// The USB frame number (1ms each, 11 bits) at the first and after the last
+// sample
+#define TELEMETRY_FRAME_START 0xFFE2
+#define TELEMETRY_FRAME_END 0xFFE3
+// 0 if the HID endpoint was ready in time, anything else if it timed out
+#define TELEMETRY_HID_TIMEOUT 0xFFE4
+// With a trigger set, the samples taken before the first one that was sent
+#define TELEMETRY_SKIPPED 0xFFE5
+// With a trigger set, 0 if the light moved and anything else if the wait ran
+// out first
+#define TELEMETRY_TRIGGER_TIMEOUT 0xFFE6
+
+// A run can have more than one segment, each timed from a step of its own.
+// After the telemetry of a segment this record starts the next one, holding
+// its variance in the time field and what it measures in the value field. The
+// rest of the segment is laid out like the first, starting with a TIME_HIGH
+// record, and its times are relative to its own step.
+// The first reset step, measured after the trigger
+#define SEGMENT_RESET 0xFFF0
+
+// Commands are framed as
+//   FRAME_COMMAND seq opcode length payload[length]
+// and every command is answered, in the order they were sent, with
+//   FRAME_RESPONSE seq opcode status length payload[length]
+// The seq is picked by the host and echoed back, so it can send several
+// commands without waiting for the answers. Commands that stream samples
+// follow their response with the stream, ended by one of the terminators.
+#define FRAME_COMMAND 0xA5
+#define FRAME_RESPONSE 0x5A
+#define FRAME_HEADER_COMMAND 4
+#define FRAME_HEADER_RESPONSE 5
+#define FRAME_MAX_PAYLOAD 32
+
+// Sent by the device, unasked with seq 0, when the host connects. The payload
+// is the name of the device
+#define OP_HELLO 'H'
+// Response payload is F_CPU as a 32 bit big endian number
+#define OP_INFO 'I'
+// Payload is the test keycode followed by the reset keycode. Replaces the input
+// sequence with one that presses the test key, and the reset key afterwards
+#define OP_KEYCODES 'K'
+// Appends a step to the input sequence, payload is
+//   index flags delay_hi delay_lo report[]
+// Steps have to be sent in order, index 0 starts a new sequence. The report is
+// 8 bytes for the keyboard (modifiers, 0, 6 keys) or 4 for the mouse (buttons,
+// x, y, wheel). After a step is sent the device waits delay milliseconds.
+// The last step without STEP_RESET is the trigger the measurement is timed
+// from, the steps before it are played first. The STEP_RESET steps are played
+// after the measurement, after which everything is released.
+#define OP_SEQUENCE 'S'
+// Streams the measurement. The payload is optional, a byte of MEASURE_ flags
+#define OP_MEASURE 'M'
+// Also measure the first reset step, in a SEGMENT_RESET after the trigger
+#define MEASURE_RESET 0x01
+// Payload is the number of keys and the time per key in milliseconds, both 16
+// bit big endian. Types a burst of keys, alternating the trigger with the first
+// reset step, and streams the light level for the whole burst like OP_MEASURE.
+// Records taken while a report went out have BURST_MARK set in the value. The
+// first of them is the release of the trigger, which went out at time 0. The
+// number of keys times the time per key is at most BURST_MAX_MS. A burst runs
+// with interrupts off and doesn't serve USB control requests until it's done,
+// this keeps it at about 2 seconds with the tail, well within the 5 seconds
+// hosts give a control transfer
+#define OP_BURST 'B'
+#define BURST_MARK 0x8000
+#define BURST_MAX_MS 1800
+// Streams 100 light levels as fast as it can
+#define OP_CALIBRATE 'C'
+// Payload is a number of USB frames, 16 bit big endian and at most
+// CLOCK_MAX_FRAMES. Counts the CPU cycles between that many start of frame
+// packets from the host and answers with the count, 32 bit big endian. The
+// host sends one every millisecond, which is a lot more accurate than the
+// crystal. Rejected if the frames stop coming
+#define OP_CLOCK 'F'
+#define CLOCK_MAX_FRAMES 5000
+// Payload is a threshold in ADC counts and the wait in milliseconds, both 16 bit
+// big endian, with the number of pretrigger samples in between. From then on
+// OP_MEASURE holds the samples back until the light is at least threshold away
+// from where it was before the key, in either direction, or the wait runs out.
+// The stream starts right after the sample that got there, and the pretrigger
+// samples up to and including it follow the stream, after a TIME_HIGH record
+// of their own, so the host has to put them back in order. A threshold of 0
+// streams everything again. Bursts are never held back. The wait is at most
+// TRIGGER_MAX_WAIT. The measurement runs with interrupts off and doesn't serve
+// USB control requests until it's done, this keeps it at about 2 seconds, well
+// within the 5 seconds hosts give a control transfer
+#define OP_TRIGGER 'T'
+#define TRIGGER_MAX_PRETRIGGER 31
+#define TRIGGER_MAX_WAIT 1900
+// Watches the light without touching the keyboard, until the host sends the
+// next command. The ADC runs free, so the samples are MONITOR_SAMPLE_CYCLES
+// apart and don't carry a time of their own. They come in blocks of
+//   MONITOR_SYNC time[4] packed[MONITOR_BLOCK * 5 / 4]
+// where time is the 32 bit timer at the first sample of the block and every
+// 4 samples are packed into 5 bytes, their upper 8 bits in order followed by
+// a byte holding their lower 2 bits, the first sample in the top bits. Samples
+// the host didn't read in time are left out, which shows as a gap between the
+// times of two blocks. Only whole blocks are sent, the last one is followed by
+// a terminator and then the answer to the command that stopped it
+#define OP_MONITOR 'P'
+#define MONITOR_SYNC 0xFFFC
+#define MONITOR_BLOCK 64
+#define MONITOR_SAMPLE_CYCLES 832
+
+#define STEP_MOUSE 0x01
+#define STEP_RESET 0x02
+#define STEP_HEADER 4
+#define STEP_KEYBOARD_REPORT 8
+#define STEP_MOUSE_REPORT 4
+#define SEQUENCE_MAX_STEPS 16
+
+#define STATUS_ACCEPT 0
+#define STATUS_REJECT 1
@@ -1,6 +1,7 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <avr/boot.h>
 #include <stdlib.h>
 
 #include "usb_serial.h"
@@ -71,7 +72,11 @@
 #define STR_MANUFACTURER	L"Delusional"
 #define STR_PRODUCT		L"ScreenTimer"
 
-#define STR_SERIAL_NUMBER	L"1"
+// The serial number is made up at startup from the lot, wafer and position on
+// the wafer the chip came from, which the factory leaves in the signature row.
+// That way every device can be told apart without flashing them differently
+#define SERIAL_NUMBER_START	0x0E
+#define SERIAL_NUMBER_BYTES	10
 
 #define VENDOR_ID		0x16C0
 #define PRODUCT_ID		0x047A
@@ -97,12 +102,13 @@
 // microcontroller how we want it to understand us.
 #define ENDPOINT0_SIZE      16
 
-#define MAX_ENDPOINT 4
+#define MAX_ENDPOINT 5
 
-#define KEYBOARD_ENDPOINT   1
+#define KEYBOARD_ENDPOINT   USB_KEYBOARD_ENDPOINT
 #define CDC_ACM_ENDPOINT    2
 #define CDC_RX_ENDPOINT     3
 #define CDC_TX_ENDPOINT     4
+#define MOUSE_ENDPOINT      USB_MOUSE_ENDPOINT
 
 // Crucually the keyboard buffer should be single buffered to allow us to
 // detect when the host read it
@@ -114,8 +120,11 @@
 #define CDC_RX_BUFFER       EP_DOUBLE_BUFFER
 #define CDC_TX_SIZE         64
 #define CDC_TX_BUFFER       EP_DOUBLE_BUFFER
+// Single buffered for the same reason as the keyboard
+#define MOUSE_SIZE          8
+#define MOUSE_BUFFER        EP_SINGLE_BUFFER
 
-#define ENDPOINT_CONFIG_LEN 4
+#define ENDPOINT_CONFIG_LEN 5
 struct Endpoint {
 	uint8_t en;
 	uint8_t type;
@@ -125,13 +134,14 @@ static const struct Endpoint PROGMEM endpoint_config_table[ENDPOINT_CONFIG_LEN]
 	{1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER},
 	{1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(CDC_ACM_SIZE) | CDC_ACM_BUFFER},
 	{1, EP_TYPE_BULK_OUT,      EP_SIZE(CDC_RX_SIZE) | CDC_RX_BUFFER},
-	{1, EP_TYPE_BULK_IN,       EP_SIZE(CDC_TX_SIZE) | CDC_TX_BUFFER}
+	{1, EP_TYPE_BULK_IN,       EP_SIZE(CDC_TX_SIZE) | CDC_TX_BUFFER},
+	{1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(MOUSE_SIZE) | MOUSE_BUFFER}
 };
 
 // Descriptor data
 // This is the stuff the host uses to detect which kind of device we are. In
-// our case we are a USB HID device with a CDC_ACM serial interface and
-// a keyboard
+// our case we are a USB HID device with a CDC_ACM serial interface,
+// a keyboard and a mouse
 
 static const uint8_t PROGMEM device_descriptor[] = {
 	18,                               // bLength
@@ -161,6 +171,7 @@ static const uint8_t PROGMEM device_descriptor[] = {
 #define INTERF_HID              0x03
 #define INTERF_SUB_HID_BOOT     0x01
 #define INTERF_PROTO_HID_KBD    0x01
+#define INTERF_PROTO_HID_MOUSE  0x02
 
 #define INTERF_CDC_CLASS        0x02
 #define INTERF_CDC_DATA         0x0A
@@ -180,6 +191,7 @@ static const uint8_t PROGMEM device_descriptor[] = {
 
 #define SERIAL_INTERFACE 1
 #define KEYBOARD_INTERFACE 2
+#define MOUSE_INTERFACE 3
 
 // Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
 static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
@@ -217,15 +229,47 @@ static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
 	0xc0                 // End Collection
 };
 
-#define CONFIG1_DESC_SIZE (9+9+5+5+4+5+7+9+7+7+9+9+7)
+// Three buttons, X, Y and a wheel. Boot mouse compatible
+static const uint8_t PROGMEM mouse_hid_report_desc[] = {
+	0x05, 0x01,          // Usage Page (Generic Desktop)
+	0x09, 0x02,          // Usage (Mouse)
+	0xA1, 0x01,          // Collection (Application)
+	0x09, 0x01,          //   Usage (Pointer)
+	0xA1, 0x00,          //   Collection (Physical)
+	0x05, 0x09,          //     Usage Page (Buttons)
+	0x19, 0x01,          //     Usage Minimum (1)
+	0x29, 0x03,          //     Usage Maximum (3)
+	0x15, 0x00,          //     Logical Minimum (0)
+	0x25, 0x01,          //     Logical Maximum (1)
+	0x95, 0x03,          //     Report Count (3)
+	0x75, 0x01,          //     Report Size (1)
+	0x81, 0x02,          //     Input (Data, Variable, Absolute) ;Buttons
+	0x95, 0x01,          //     Report Count (1)
+	0x75, 0x05,          //     Report Size (5)
+	0x81, 0x03,          //     Input (Constant)                 ;Padding
+	0x05, 0x01,          //     Usage Page (Generic Desktop)
+	0x09, 0x30,          //     Usage (X)
+	0x09, 0x31,          //     Usage (Y)
+	0x09, 0x38,          //     Usage (Wheel)
+	0x15, 0x81,          //     Logical Minimum (-127)
+	0x25, 0x7F,          //     Logical Maximum (127)
+	0x75, 0x08,          //     Report Size (8)
+	0x95, 0x03,          //     Report Count (3)
+	0x81, 0x06,          //     Input (Data, Variable, Relative) ;X, Y, Wheel
+	0xC0,                //   End Collection
+	0xC0                 // End Collection
+};
+
+#define CONFIG1_DESC_SIZE (9+9+5+5+4+5+7+9+7+7+9+9+7+9+9+7)
 #define HID_DESC_OFFSET   (9+9+5+5+4+5+7+9+7+7+9)
+#define MOUSE_HID_DESC_OFFSET (9+9+5+5+4+5+7+9+7+7+9+9+7+9)
 static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	// configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
 	9,                                         // bLength;
 	DESC_CONFIG,                               // bDescriptorType;
 	LSB(CONFIG1_DESC_SIZE),                    // wTotalLength
 	MSB(CONFIG1_DESC_SIZE),
-	3,                                         // bNumInterfaces
+	4,                                         // bNumInterfaces
 	CONFIG_VALUE,                              // bConfigurationValue
 	0,                                         // iConfiguration
 	CONFIG_SELFPOWERED,                        // bmAttributes
@@ -318,6 +362,32 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	KEYBOARD_ENDPOINT | 0x80,                  // bEndpointAddress
 	0x03,                                      // bmAttributes (0x03=intr)
 	KEYBOARD_SIZE, 0,                          // wMaxPacketSize
+	1,                                         // bInterval
+	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+	9,                                         // bLength
+	DESC_INTERF,                               // bDescriptorType
+	MOUSE_INTERFACE,                           // bInterfaceNumber
+	0,                                         // bAlternateSetting
+	1,                                         // bNumEndpoints
+	INTERF_HID,                                // bInterfaceClass (0x03 = HID)
+	INTERF_SUB_HID_BOOT,                       // bInterfaceSubClass (0x01 = Boot)
+	INTERF_PROTO_HID_MOUSE,                    // bInterfaceProtocol (0x02 = Mouse)
+	0,                                         // iInterface
+	// HID interface descriptor, HID 1.11 spec, section 6.2.1
+	9,                                         // bLength
+	0x21,                                      // bDescriptorType
+	0x11, 0x01,                                // bcdHID
+	0,                                         // bCountryCode
+	1,                                         // bNumDescriptors
+	0x22,                                      // bDescriptorType
+	sizeof(mouse_hid_report_desc),             // wDescriptorLength
+	0,
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,                                         // bLength
+	DESC_ENDPOI,                               // bDescriptorType
+	MOUSE_ENDPOINT | 0x80,                     // bEndpointAddress
+	0x03,                                      // bmAttributes (0x03=intr)
+	MOUSE_SIZE, 0,                             // wMaxPacketSize
 	1                                          // bInterval
 };
 
@@ -341,10 +411,15 @@ static const struct usb_string_descriptor_struct PROGMEM string2 = {
 	3,
 	{STR_PRODUCT}
 };
-static const struct usb_string_descriptor_struct PROGMEM string3 = {
-	sizeof(STR_SERIAL_NUMBER),
+// Two hex digits for every byte, filled in by usb_init
+static struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	int16_t wString[2 * SERIAL_NUMBER_BYTES];
+} string3 = {
+	2 + 4 * SERIAL_NUMBER_BYTES,
 	3,
-	{STR_SERIAL_NUMBER}
+	{0}
 };
 
 // This table defines which descriptor data is sent for each specific request
@@ -359,10 +434,11 @@ static struct descriptor {
 	{0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
 	{0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
 	{0x2100, KEYBOARD_INTERFACE, config1_descriptor+HID_DESC_OFFSET, 9},
+	{0x2200, MOUSE_INTERFACE, mouse_hid_report_desc, sizeof(mouse_hid_report_desc)},
+	{0x2100, MOUSE_INTERFACE, config1_descriptor+MOUSE_HID_DESC_OFFSET, 9},
 	{0x0300, 0x0000, (const uint8_t *)&string0, 4},
 	{0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
-	{0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)},
-	{0x0303, 0x0409, (const uint8_t *)&string3, sizeof(STR_SERIAL_NUMBER)}
+	{0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
 };
 #define NUM_DESC_LIST (sizeof(descriptor_list)/sizeof(struct descriptor))
 
@@ -372,14 +448,22 @@ static volatile uint8_t usb_configuration=0;
 // the time remaining before we transmit any partially full
 // packet, or send a zero length packet.
 static volatile uint8_t transmit_flush_timer=0;
+
+void (*volatile usb_frame_hook)() = NULL;
+#ifndef USB_SERIAL_TX_RING
 static uint8_t transmit_previous_timeout=0;
+#endif
 
 #define KEYBOARD_KEYS_LEN 6
+uint8_t keyboard_modifier = 0;
 uint8_t keyboard_keys[KEYBOARD_KEYS_LEN] = {0, 0, 0, 0, 0, 0};
 // The USB host expects to be able to set and read these
 static uint8_t keyboard_protocol = 1;
 static uint8_t keyboard_idle_config = 125;
 
+uint8_t mouse_report[MOUSE_REPORT_LEN] = {0, 0, 0, 0};
+static uint8_t mouse_protocol = 1;
+
 // Serial port settings (baud rate, control signals, etc) set by the PC. The
 // host expects to be able to read them out again
 #define CDC_LINE_LEN 7
@@ -430,7 +514,17 @@ static uint8_t waitForInOrOut() {
 	return intr & _BV(RXOUTI);
 }
 
+static void read_serial_number() {
+	static const char PROGMEM digits[] = "0123456789ABCDEF";
+	for (uint8_t i = 0; i < SERIAL_NUMBER_BYTES; i++) {
+		uint8_t b = boot_signature_byte_get(SERIAL_NUMBER_START + i);
+		string3.wString[2 * i] = pgm_read_byte(digits + (b >> 4));
+		string3.wString[2 * i + 1] = pgm_read_byte(digits + (b & 15));
+	}
+}
+
 void usb_init() {
+	read_serial_number();
 	HW_CONFIG();
 	USB_FREEZE();                    // enable USB
 	PLL_CONFIG();                    // config PLL, 16 MHz xtal
@@ -475,6 +569,24 @@ retry:;
 	return c;
 }
 
+uint8_t usb_serial_available() {
+	if (!usb_configuration) return 0;
+
+	uint8_t intr_state = SREG;
+	cli();
+
+	setEP(CDC_RX_ENDPOINT);
+retry:;
+	uint8_t intr = UEINTX;
+	if (!bufferAvailable(intr) && containsNewPacket(intr)) {
+		// an empty packet, nothing to read in it
+		rxRelease();
+		goto retry;
+	}
+	SREG = intr_state;
+	return bufferAvailable(intr) != 0;
+}
+
 void usb_serial_flush_input() {
 	if(!usb_configuration) return;
 
@@ -489,17 +601,85 @@ void usb_serial_flush_input() {
 	SREG = intr_state;
 }
 
-int8_t usb_serial_putchar(uint8_t c) {
+// Copy as much as fits into the current bank, and send it off if it's full.
+// Returns how many bytes were written
+static uint8_t txFillBank(const uint8_t* buf, uint8_t size, uint8_t pgm) {
+	uint8_t n = CDC_TX_SIZE - UEBCLX;
+	if (n > size) n = size;
+	for (uint8_t i = 0; i < n; i++) {
+		UEDATX = pgm ? pgm_read_byte(buf + i) : buf[i];
+	}
+	if (!bufferAvailable(UEINTX))
+		txRelease();
+	return n;
+}
 
-	if (!usb_configuration) return -1;
+#ifdef USB_SERIAL_TX_RING
+// Writes go into this ring and are moved into the endpoint by the TX
+// interrupt, whole banks at a time. The indices wrap on their own
+static uint8_t tx_ring[256];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
 
-	uint8_t intr_state = SREG;
-	cli();
+static void txEnableInterrupt() {
 	setEP(CDC_TX_ENDPOINT);
+	UEIENX = _BV(TXINE);
+}
+
+// Move data from the ring into the endpoint. Called from the interrupt, or
+// with interrupts disabled
+static void txRingService() {
+	setEP(CDC_TX_ENDPOINT);
+	while (tx_head != tx_tail && bufferAvailable(UEINTX)) {
+		// Only copy up to the end of the ring, the next round takes the rest
+		uint8_t tail = tx_tail;
+		uint8_t contiguous = (tx_head > tail ? tx_head : 0) - tail;
+		tx_tail = tail + txFillBank(tx_ring + tail, contiguous, 0);
+		transmit_flush_timer = TRANSMIT_FLUSH_TIMEOUT;
+	}
+	if (tx_head == tx_tail) {
+		// Nothing left, stop the interrupt from firing on every free bank
+		UEIENX = 0;
+	}
+}
+
+static int8_t tx_write(const uint8_t* buf, uint16_t size, uint8_t pgm) {
+	if (!usb_configuration) return -1;
+
+	uint8_t timeout = UDFNUML + TRANSMIT_TIMEOUT;
+	while (size) {
+		uint8_t intr_state = SREG;
+		cli();
+		uint8_t head = tx_head;
+		uint8_t space = tx_tail - head - 1;
+		if (space == 0) {
+			// Without interrupts nobody else is going to empty the ring
+			if (!(intr_state & _BV(SREG_I)))
+				txRingService();
+			SREG = intr_state;
+			if (UDFNUML == timeout || !usb_configuration) return -1;
+			continue;
+		}
+		if (space > size) space = size;
+		size -= space;
+		while (space--) {
+			tx_ring[head++] = pgm ? pgm_read_byte(buf++) : *buf++;
+		}
+		tx_head = head;
+		txEnableInterrupt();
+		SREG = intr_state;
+		timeout = UDFNUML + TRANSMIT_TIMEOUT;
+	}
+	return 0;
+}
+#else
+// Wait for the TX endpoint to have room. Must be called with interrupts
+// disabled and the endpoint selected, interrupts are restored to intr_state
+// while we wait. Returns -1 if the host isn't listening
+static int8_t txWaitBank(uint8_t* intr_state) {
 	// if we gave up due to timeout before, don't wait again
 	if (transmit_previous_timeout) {
 		if (!bufferAvailable(UEINTX)) {
-			SREG = intr_state;
 			return -1;
 		}
 		transmit_previous_timeout = 0;
@@ -509,7 +689,7 @@ int8_t usb_serial_putchar(uint8_t c) {
 	while (1) {
 		// are we ready to transmit?
 		if (bufferAvailable(UEINTX)) break;
-		SREG = intr_state;
+		SREG = *intr_state;
 		// have we waited too long?  This happens if the user
 		// is not running an application that is listening
 		if (UDFNUML == timeout) {
@@ -519,25 +699,59 @@ int8_t usb_serial_putchar(uint8_t c) {
 		// has the USB gone offline?
 		if (!usb_configuration) return -1;
 		// get ready to try checking again
-		intr_state = SREG;
+		*intr_state = SREG;
 		cli();
 		setEP(CDC_TX_ENDPOINT);
 	}
-	// actually write the byte into the FIFO
-	UEDATX = c;
-	// if this completed a packet, transmit it now!
-	if (!bufferAvailable(UEINTX))
-			txRelease();
+	return 0;
+}
+
+static int8_t tx_write(const uint8_t* buf, uint16_t size, uint8_t pgm) {
+	if (!usb_configuration) return -1;
+
+	uint8_t intr_state = SREG;
+	cli();
+	setEP(CDC_TX_ENDPOINT);
+	while (size) {
+		if (txWaitBank(&intr_state)) {
+			SREG = intr_state;
+			return -1;
+		}
+		uint8_t n = txFillBank(buf, size > CDC_TX_SIZE ? CDC_TX_SIZE : size, pgm);
+		buf += n;
+		size -= n;
+	}
 	transmit_flush_timer = TRANSMIT_FLUSH_TIMEOUT;
 	SREG = intr_state;
 	return 0;
 }
+#endif
+
+int8_t usb_serial_putchar(uint8_t c) {
+	return tx_write(&c, 1, 0);
+}
+
+int8_t usb_serial_write(const uint8_t* buf, uint16_t size) {
+	return tx_write(buf, size, 0);
+}
+
+int8_t usb_serial_write_P(const char* buf, uint16_t size) {
+	return tx_write((const uint8_t*)buf, size, 1);
+}
 
 void usb_serial_flush_output() {
 	uint8_t intr_state;
 
 	intr_state = SREG;
 	cli();
+#ifdef USB_SERIAL_TX_RING
+	// Whoever flushes wants the data out now, and might go on to write to the
+	// endpoint directly, so drain the ring while we wait
+	uint8_t timeout = UDFNUML + TRANSMIT_TIMEOUT;
+	while (tx_head != tx_tail && usb_configuration && UDFNUML != timeout) {
+		txRingService();
+	}
+#endif
 	if (transmit_flush_timer) {
 		setEP(CDC_TX_ENDPOINT);
 		txRelease();
@@ -552,7 +766,7 @@ uint8_t usb_serial_get_control() {
 
 // Keyboard stuff
 static void keyboard_write_report() {
-	UEDATX = 0;
+	UEDATX = keyboard_modifier;
 	UEDATX = 0;
 	for (uint8_t i = 0; i < KEYBOARD_KEYS_LEN; i++) {
 		UEDATX = keyboard_keys[i];
@@ -560,9 +774,13 @@ static void keyboard_write_report() {
 }
 
 int8_t usb_keyboard_ready() {
+	return usb_hid_ready(KEYBOARD_ENDPOINT);
+}
+
+int8_t usb_hid_ready(uint8_t ep) {
 	if (!usb_configuration) return -1;
 
-	setEP(KEYBOARD_ENDPOINT);
+	setEP(ep);
 	uint8_t timeout = UDFNUML + 50;
 	while (1) {
 		// are we ready to transmit?
@@ -575,7 +793,7 @@ int8_t usb_keyboard_ready() {
 		if (UDFNUML == timeout) return -1;
 
 		// get ready to try checking again
-		setEP(KEYBOARD_ENDPOINT);
+		setEP(ep);
 	}
 
 	return 0;
@@ -599,6 +817,31 @@ int8_t usb_keyboard_send() {
 	return 0;
 }
 
+// Mouse stuff
+static void mouse_write_report() {
+	for (uint8_t i = 0; i < MOUSE_REPORT_LEN; i++) {
+		UEDATX = mouse_report[i];
+	}
+}
+
+int8_t usb_mouse_send() {
+	if (!usb_configuration) return -1;
+
+	uint8_t intr_state = SREG;
+	cli();
+
+	if(usb_hid_ready(MOUSE_ENDPOINT)) {
+		SREG = intr_state;
+		return -1;
+	}
+
+	mouse_write_report();
+	txRelease();
+
+	SREG = intr_state;
+	return 0;
+}
+
 // USB Device Interrupt
 ISR(USB_GEN_vect)
 {
@@ -616,6 +859,8 @@ ISR(USB_GEN_vect)
 	}
 
 	if ((intbits & _BV(SOFI)) && usb_configuration) {
+		void (*hook)() = usb_frame_hook;
+		if (hook) hook();
 		uint8_t t = transmit_flush_timer;
 		if (t) {
 			transmit_flush_timer = --t;
@@ -646,6 +891,17 @@ static void read_request(struct USBReq* req) {
 // USB Endpoint Interrupt
 ISR(USB_COM_vect)
 {
+#ifdef USB_SERIAL_TX_RING
+	if (UEINT & _BV(CDC_TX_ENDPOINT)) {
+		// We might have interrupted someone in the middle of using another
+		// endpoint
+		uint8_t ep = UENUM;
+		txRingService();
+		setEP(ep);
+	}
+	// The rest is only for the control endpoint
+	if (!(UEINT & _BV(0))) return;
+#endif
 	setEP(0);
 	uint8_t intbits = UEINTX;
 	if (intbits & _BV(RXSTPI)) {
@@ -656,6 +912,14 @@ ISR(USB_COM_vect)
 		read_request(&req);
 		UEINTX = ~(_BV(RXSTPI) | _BV(RXOUTI) | _BV(TXINI));
 		if (req.bRequest == GET_DESCRIPTOR) {
+			// Everything but the serial number is in flash
+			uint8_t pgm = 1;
+			if (req.wValue == 0x0303 && req.wIndex == 0x0409) {
+				desc_addr = (const uint8_t*)&string3;
+				desc_length = sizeof(string3);
+				pgm = 0;
+				goto success;
+			}
 			for (uint8_t i = 0; i < NUM_DESC_LIST; i++) {
 				const uint8_t* base = (const uint8_t*)(&descriptor_list[i]);
 				uint16_t value = pgm_read_word(base + offsetof(struct descriptor, wValue));
@@ -681,7 +945,7 @@ success:;
 				// send IN packet
 				uint8_t n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
 				for (uint8_t i = 0; i < n; i++) {
-					UEDATX = pgm_read_byte(desc_addr++);
+					UEDATX = pgm ? pgm_read_byte(desc_addr++) : *desc_addr++;
 				}
 				len -= n;
 				usb_send_in();
@@ -710,7 +974,7 @@ success:;
 					UECFG1X = pgm_read_byte(base + offsetof(struct Endpoint, size));
 				}
 			}
-			UERST = 0x1E;
+			UERST = 0x3E;
 			UERST = 0;
 			return;
 		}
@@ -814,6 +1078,33 @@ success:;
 				}
 			}
 		}
+		if (req.wIndex == MOUSE_INTERFACE) {
+			if (req.bmRequestType == 0xA1) {
+				if (req.bRequest == HID_GET_REPORT) {
+					usb_wait_in_ready();
+					mouse_write_report();
+					usb_send_in();
+					return;
+				}
+				if (req.bRequest == HID_GET_PROTOCOL) {
+					usb_wait_in_ready();
+					UEDATX = mouse_protocol;
+					usb_send_in();
+					return;
+				}
+			}
+			if (req.bmRequestType == 0x21) {
+				if (req.bRequest == HID_SET_IDLE) {
+					usb_send_in();
+					return;
+				}
+				if (req.bRequest == HID_SET_PROTOCOL) {
+					mouse_protocol = req.wValue;
+					usb_send_in();
+					return;
+				}
+			}
+		}
 	}
 	UECONX = (1<<STALLRQ) | (1<<EPEN);	// stall
 }
@@ -26,18 +26,45 @@ uint8_t usb_configured();
 
 // RX
 int16_t usb_serial_getchar();
+// Whether there's a byte to get, without taking it
+uint8_t usb_serial_available();
 void usb_serial_flush_input();
 
 // TX
+// Build with -DUSB_SERIAL_TX_RING to queue writes in RAM and have the TX
+// interrupt move them into the endpoint, instead of waiting for it here.
 int8_t usb_serial_putchar(uint8_t c);
+int8_t usb_serial_write(const uint8_t* buf, uint16_t size);
+// Same as usb_serial_write, but buf is in program memory
+int8_t usb_serial_write_P(const char* buf, uint16_t size);
 void usb_serial_flush_output();
 
 // Control
 uint8_t usb_serial_get_control();
 
+// Called from the USB interrupt on every start of frame packet while
+// configured, if set
+extern void (*volatile usb_frame_hook)();
+
+// HID stuff
+#define USB_KEYBOARD_ENDPOINT 1
+#define USB_MOUSE_ENDPOINT 5
+// Select the endpoint and wait until the host has read the last report
+int8_t usb_hid_ready(uint8_t ep);
+
 // Keyboard stuff
+extern uint8_t keyboard_modifier;
 extern uint8_t keyboard_keys[6];
 
+#define KEY_CTRL          0x01
+#define KEY_SHIFT         0x02
+#define KEY_ALT           0x04
+#define KEY_GUI           0x08
+#define KEY_RIGHT_CTRL    0x10
+#define KEY_RIGHT_SHIFT   0x20
+#define KEY_RIGHT_ALT     0x40
+#define KEY_RIGHT_GUI     0x80
+
 // Keyboard keys
 #define KEY_A             4
 #define KEY_B             5
@@ -138,3 +165,13 @@ extern uint8_t keyboard_keys[6];
 
 int8_t usb_keyboard_send();
 
+// Mouse stuff
+// Buttons, X, Y and wheel. The last three are signed
+#define MOUSE_REPORT_LEN 4
+extern uint8_t mouse_report[MOUSE_REPORT_LEN];
+
+#define MOUSE_LEFT        0x01
+#define MOUSE_RIGHT       0x02
+#define MOUSE_MIDDLE      0x04
+
+int8_t usb_mouse_send();